@@ -6,8 +6,10 @@
         'src/animated_gif.cpp',
         'src/async_animated_gif.cpp',
         'src/buffer_compat.cpp',
+        'src/buffer_pool.cpp',
         'src/common.cpp',
         'src/dynamic_gif_stack.cpp',
+        'src/file_writer.cpp',
         'src/gif.cpp',
         'src/gif_encoder.cpp',
         'src/module.cpp',
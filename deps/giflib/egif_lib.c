@@ -37,6 +37,13 @@ static int EGifPutWord(int Word, GifFileType * GifFile);
 static int EGifSetupCompress(GifFileType * GifFile);
 static int EGifCompressLine(GifFileType * GifFile, GifPixelType * Line,
                             int LineLen);
+static int EGifRunLength(const GifPixelType * Line, int LineLen,
+                         GifPixelType Pixel);
+static int EGifClearTable(GifFileType * GifFile);
+static bool EGifTableDegraded(GifFilePrivateType * Private);
+static int EGifSetupLossy(GifFileType * GifFile);
+static int EGifLossyMatch(GifFilePrivateType * Private, int CrntCode,
+                          GifPixelType Pixel);
 static int EGifCompressOutput(GifFileType * GifFile, int Code);
 static int EGifBufferedOutput(GifFileType * GifFile, GifByteType * Buf,
                               int c);
@@ -122,6 +129,10 @@ EGifOpenFileHandle(const int FileHandle, int *Error)
     Private->FileHandle = FileHandle;
     Private->File = f;
     Private->FileState = FILE_STATE_WRITE;
+    Private->LossyError = 0;
+    Private->TransparentIndex = -1;
+    Private->LossyNeighbors = NULL;
+    Private->ClearThreshold = 0;
 
     Private->Write = (OutputFunc) 0;    /* No user write routine (MRB) */
     GifFile->UserData = (void *)NULL;    /* No user write handle (MRB) */
@@ -171,6 +182,10 @@ EGifOpen(void *userData, OutputFunc writeFunc, int *Error)
     Private->FileHandle = 0;
     Private->File = (FILE *) 0;
     Private->FileState = FILE_STATE_WRITE;
+    Private->LossyError = 0;
+    Private->TransparentIndex = -1;
+    Private->LossyNeighbors = NULL;
+    Private->ClearThreshold = 0;
 
     Private->Write = writeFunc;    /* User write routine (MRB) */
     GifFile->UserData = userData;    /* User write handle (MRB) */
@@ -600,6 +615,12 @@ EGifPutExtension(GifFileType *GifFile,
         return GIF_ERROR;
     }
 
+    /* Remember the transparent color, so lossy matching can leave it be: */
+    if (ExtCode == GRAPHICS_EXT_FUNC_CODE && ExtLen >= 4) {
+        const GifByteType *GCB = (const GifByteType *)Extension;
+        Private->TransparentIndex = (GCB[0] & 0x01) ? GCB[3] : -1;
+    }
+
     if (ExtCode == 0)
         InternalWrite(GifFile, (GifByteType *)&ExtLen, 1);
     else {
@@ -724,6 +745,74 @@ EGifPutCodeNext(GifFileType *GifFile, const GifByteType *CodeBlock)
     return GIF_OK;
 }
 
+/******************************************************************************
+ Make the LZ compression lossy: when the current string can't be extended
+ with the next pixel, it may be extended with a pixel whose color is within
+ MaxError (euclidean distance in RGB) of it instead, in the style of
+ gifsicle's --lossy. The transparent color is never substituted.
+ Takes effect from the next image descriptor on; 0 turns it off.
+******************************************************************************/
+int
+EGifSetLossyError(GifFileType *GifFile, const int MaxError)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+    if (!IS_WRITEABLE(Private)) {
+        /* This file was NOT open for writing: */
+        GifFile->Error = E_GIF_ERR_NOT_WRITEABLE;
+        return GIF_ERROR;
+    }
+
+    Private->LossyError = MaxError > 0 ? MaxError : 0;
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Normally the LZ table is cleared as soon as it is full. With a Threshold
+ the full table is kept and codes from it keep being used for as long as
+ the bits per pixel it achieves stay within Threshold percent of what it
+ took to fill it; only then a clear code is sent. This pays off on
+ repetitive content. Takes effect from the next image descriptor on; 0
+ restores clearing at once.
+******************************************************************************/
+int
+EGifSetClearThreshold(GifFileType *GifFile, const int Threshold)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+    if (!IS_WRITEABLE(Private)) {
+        /* This file was NOT open for writing: */
+        GifFile->Error = E_GIF_ERR_NOT_WRITEABLE;
+        return GIF_ERROR;
+    }
+
+    Private->ClearThreshold = Threshold > 0 ? Threshold : 0;
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Tell lossy matching which color of the next image is transparent, for when
+ its graphics control extension isn't written through this GifFile (which
+ does the same). -1 for none. Applies to the next image descriptor only.
+******************************************************************************/
+int
+EGifSetTransparentIndex(GifFileType *GifFile, const int TransparentIndex)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+    if (!IS_WRITEABLE(Private)) {
+        /* This file was NOT open for writing: */
+        GifFile->Error = E_GIF_ERR_NOT_WRITEABLE;
+        return GIF_ERROR;
+    }
+
+    Private->TransparentIndex = TransparentIndex;
+
+    return GIF_OK;
+}
+
 /******************************************************************************
  This routine should be called last, to close the GIF file.
 ******************************************************************************/
@@ -762,6 +851,9 @@ EGifCloseFile(GifFileType *GifFile)
     if (Private) {
         if (Private->HashTable) {
             free((char *) Private->HashTable);
+        }
+        if (Private->LossyNeighbors) {
+            free((char *) Private->LossyNeighbors);
         }
 	    free((char *) Private);
     }
@@ -831,6 +923,16 @@ EGifSetupCompress(GifFileType *GifFile)
     Private->CrntCode = FIRST_CODE;    /* Signal that this is first one! */
     Private->CrntShiftState = 0;    /* No information in CrntShiftDWord. */
     Private->CrntShiftDWord = 0;
+    Private->CodeBits = Private->CodePixels = 0;
+    Private->BaseBits = Private->BasePixels = 0;
+    memset(Private->RunNext, 0, sizeof(Private->RunNext));
+
+    if (Private->LossyError > 0 && EGifSetupLossy(GifFile) == GIF_ERROR) {
+        GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+        return GIF_ERROR;
+    }
+    /* The transparency extension only applies to this image. */
+    Private->TransparentIndex = -1;
 
    /* Clear hash table and send Clear to make sure the decoder do the same. */
     _ClearHashTable(Private->HashTable);
@@ -853,21 +955,41 @@ EGifCompressLine(GifFileType *GifFile,
                  GifPixelType *Line,
                  const int LineLen)
 {
-    int i = 0, CrntCode, NewCode;
+    int i = 0, CrntCode, NewCode, RunLen, RunPixel;
     unsigned long NewKey;
     GifPixelType Pixel;
     GifHashTableType *HashTable;
+    unsigned short *RunNext;
     GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
 
     HashTable = Private->HashTable;
+    RunNext = Private->RunNext;
 
-    if (Private->CrntCode == FIRST_CODE)    /* Its first time! */
-        CrntCode = Line[i++];
-    else
+    if (Private->CrntCode == FIRST_CODE) {    /* Its first time! */
+        CrntCode = RunPixel = Line[i++];
+    } else {
         CrntCode = Private->CrntCode;    /* Get last code in compression. */
+        RunPixel = Private->CrntRunPixel;
+    }
 
     while (i < LineLen) {   /* Decode LineLen items. */
+        /* Inside a run of one pixel, while CrntCode is a run of that same
+         * pixel the codes of the longer runs are known without asking the
+         * hash table - just follow them:
+         */
+        if (Line[i] == RunPixel && RunNext[CrntCode] != 0) {
+            RunLen = EGifRunLength(Line + i, LineLen - i, RunPixel);
+            while (RunLen > 0 && RunNext[CrntCode] != 0) {
+                CrntCode = RunNext[CrntCode];
+                RunLen--;
+                i++;
+                Private->CodePixels++;
+            }
+            continue;
+        }
+
         Pixel = Line[i++];  /* Get next pixel from stream. */
+        Private->CodePixels++;
         /* Form a new unique key to search hash table for the code combines 
          * CrntCode as Prefix string with Pixel as postfix char.
          */
@@ -876,41 +998,49 @@ EGifCompressLine(GifFileType *GifFile,
             /* This Key is already there, or the string is old one, so
              * simple take new code as our CrntCode:
              */
+            if (Pixel == RunPixel)
+                RunNext[CrntCode] = NewCode;
+            else
+                RunPixel = -1;
             CrntCode = NewCode;
+        } else if (Private->LossyError > 0 &&
+                   (NewCode = EGifLossyMatch(Private, CrntCode, Pixel)) >= 0) {
+            /* A close enough color extends the string - take that instead: */
+            CrntCode = NewCode;
+            RunPixel = -1;
         } else {
             /* Put it in hash table, output the prefix code, and make our
              * CrntCode equal to Pixel.
              */
+            Private->CodeBits += Private->RunningBits;
             if (EGifCompressOutput(GifFile, CrntCode) == GIF_ERROR) {
                 GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
                 return GIF_ERROR;
             }
-            CrntCode = Pixel;
 
             /* If however the HashTable if full, we send a clear first and
-             * Clear the hash table.
+             * Clear the hash table - unless it still compresses well enough.
              */
             if (Private->RunningCode >= LZ_MAX_CODE) {
-                /* Time to do some clearance: */
-                if (EGifCompressOutput(GifFile, Private->ClearCode)
-                        == GIF_ERROR) {
-                    GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
-                    return GIF_ERROR;
+                if (Private->ClearThreshold == 0 || EGifTableDegraded(Private)) {
+                    /* Time to do some clearance: */
+                    if (EGifClearTable(GifFile) == GIF_ERROR)
+                        return GIF_ERROR;
                 }
-                Private->RunningCode = Private->EOFCode + 1;
-                Private->RunningBits = Private->BitsPerPixel + 1;
-                Private->MaxCode1 = 1 << Private->RunningBits;
-                _ClearHashTable(HashTable);
             } else {
                 /* Put this unique key with its relative Code in hash table: */
+                if (Pixel == RunPixel)
+                    RunNext[CrntCode] = Private->RunningCode;
                 _InsertHashTable(HashTable, NewKey, Private->RunningCode++);
             }
+            CrntCode = RunPixel = Pixel;
         }
 
     }
 
     /* Preserve the current state of the compression algorithm: */
     Private->CrntCode = CrntCode;
+    Private->CrntRunPixel = RunPixel;
 
     if (Private->PixelCount == 0) {
         /* We are done - output last Code and flush output buffers: */
@@ -931,6 +1061,180 @@ EGifCompressLine(GifFileType *GifFile,
     return GIF_OK;
 }
 
+/******************************************************************************
+ Number of pixels equal to Pixel at the start of Line, compared 8 at a time.
+******************************************************************************/
+static int
+EGifRunLength(const GifPixelType *Line, int LineLen, GifPixelType Pixel)
+{
+    int n = 0;
+    uint64_t Word, Pattern = UINT64_C(0x0101010101010101) * Pixel;
+
+    while (n + 8 <= LineLen) {
+        memcpy(&Word, Line + n, 8);
+        if (Word != Pattern)
+            break;
+        n += 8;
+    }
+    while (n < LineLen && Line[n] == Pixel)
+        n++;
+
+    return n;
+}
+
+/******************************************************************************
+ Send a clear code and start over with an empty table.
+******************************************************************************/
+static int
+EGifClearTable(GifFileType *GifFile)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+
+    if (EGifCompressOutput(GifFile, Private->ClearCode) == GIF_ERROR) {
+        GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+        return GIF_ERROR;
+    }
+    Private->RunningCode = Private->EOFCode + 1;
+    Private->RunningBits = Private->BitsPerPixel + 1;
+    Private->MaxCode1 = 1 << Private->RunningBits;
+    Private->CodeBits = Private->CodePixels = 0;
+    Private->BaseBits = Private->BasePixels = 0;
+    memset(Private->RunNext, 0, sizeof(Private->RunNext));
+    _ClearHashTable(Private->HashTable);
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Called on every code output while the table is full. The bits per pixel it
+ took to fill the table are the first baseline; after that the output is
+ judged in windows of CLEAR_WINDOW_BITS, and a window that does better
+ becomes the baseline. Returns true once a window does more than
+ ClearThreshold percent worse than the baseline - or the table has been
+ kept for CLEAR_MAX_FROZEN_CODES codes, as a table filled on content that
+ compresses badly (noise) has a baseline too poor to ever fall behind.
+******************************************************************************/
+static bool
+EGifTableDegraded(GifFilePrivateType *Private)
+{
+    bool Degraded;
+
+    if (Private->BaseBits == 0) {
+        /* Table just filled up: */
+        Private->BaseBits = Private->CodeBits;
+        Private->BasePixels = Private->CodePixels;
+        Private->CodeBits = Private->CodePixels = 0;
+        Private->FrozenCodes = 0;
+        return false;
+    }
+    if (++Private->FrozenCodes >= CLEAR_MAX_FROZEN_CODES)
+        return true;
+    if (Private->CodeBits < CLEAR_WINDOW_BITS)
+        return false;
+
+    Degraded = (double)Private->CodeBits * Private->BasePixels * 100 >
+               (double)Private->BaseBits * Private->CodePixels *
+               (100 + Private->ClearThreshold);
+    if ((double)Private->CodeBits * Private->BasePixels <
+        (double)Private->BaseBits * Private->CodePixels) {
+        Private->BaseBits = Private->CodeBits;
+        Private->BasePixels = Private->CodePixels;
+    }
+    Private->CodeBits = Private->CodePixels = 0;
+
+    return Degraded;
+}
+
+/******************************************************************************
+ Setup lossy compression for this image: for every color of the color map
+ list the colors within LossyError of it, closest first. Without a color map
+ there's nothing to list and the image is compressed lossless.
+******************************************************************************/
+static int
+EGifSetupLossy(GifFileType *GifFile)
+{
+    int i, j, k, n, Dist, MaxDist, ColorCount;
+    int Dists[LOSSY_MAX_NEIGHBORS];
+    GifColorType *Colors;
+    GifByteType *Neighbors;
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+
+    if (GifFile->Image.ColorMap) {
+        ColorCount = GifFile->Image.ColorMap->ColorCount;
+        Colors = GifFile->Image.ColorMap->Colors;
+    } else if (GifFile->SColorMap) {
+        ColorCount = GifFile->SColorMap->ColorCount;
+        Colors = GifFile->SColorMap->Colors;
+    } else {
+        /* No colors to match, so no neighbors: the image goes lossless. */
+        ColorCount = 0;
+        Colors = NULL;
+    }
+    if (ColorCount > 256)
+        ColorCount = 256;
+
+    if (Private->LossyNeighbors == NULL) {
+        Private->LossyNeighbors =
+            (GifByteType *)malloc(256 * LOSSY_MAX_NEIGHBORS);
+        if (Private->LossyNeighbors == NULL)
+            return GIF_ERROR;
+    }
+    memset(Private->LossyNeighborCount, 0, sizeof(Private->LossyNeighborCount));
+
+    MaxDist = Private->LossyError * Private->LossyError;
+    for (i = 0; i < ColorCount; i++) {
+        if (i == Private->TransparentIndex)
+            continue;
+        Neighbors = Private->LossyNeighbors + i * LOSSY_MAX_NEIGHBORS;
+        n = 0;
+        for (j = 0; j < ColorCount; j++) {
+            if (j == i || j == Private->TransparentIndex)
+                continue;
+            Dist = (Colors[i].Red - Colors[j].Red) *
+                   (Colors[i].Red - Colors[j].Red) +
+                   (Colors[i].Green - Colors[j].Green) *
+                   (Colors[i].Green - Colors[j].Green) +
+                   (Colors[i].Blue - Colors[j].Blue) *
+                   (Colors[i].Blue - Colors[j].Blue);
+            if (Dist > MaxDist)
+                continue;
+            /* Insertion sort, keeping the closest LOSSY_MAX_NEIGHBORS: */
+            if (n == LOSSY_MAX_NEIGHBORS && Dist >= Dists[n - 1])
+                continue;
+            k = n < LOSSY_MAX_NEIGHBORS ? n++ : n - 1;
+            for (; k > 0 && Dists[k - 1] > Dist; k--) {
+                Dists[k] = Dists[k - 1];
+                Neighbors[k] = Neighbors[k - 1];
+            }
+            Dists[k] = Dist;
+            Neighbors[k] = j;
+        }
+        Private->LossyNeighborCount[i] = n;
+    }
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Look for a string CrntCode + a color close to Pixel in the hash table.
+ Returns its code, or -1 if there is none.
+******************************************************************************/
+static int
+EGifLossyMatch(GifFilePrivateType *Private, int CrntCode, GifPixelType Pixel)
+{
+    int i, NewCode;
+    GifByteType *Neighbors = Private->LossyNeighbors + Pixel * LOSSY_MAX_NEIGHBORS;
+
+    for (i = 0; i < Private->LossyNeighborCount[Pixel]; i++) {
+        NewCode = _ExistsHashTable(Private->HashTable,
+                                   (((uint32_t) CrntCode) << 8) + Neighbors[i]);
+        if (NewCode >= 0)
+            return NewCode;
+    }
+
+    return -1;
+}
+
 /******************************************************************************
  The LZ compression output routine:
  This routine is responsible for the compression of the bit stream into
@@ -170,6 +170,11 @@ int EGifPutCode(GifFileType *GifFile, int GifCodeSize,
 int EGifPutCodeNext(GifFileType *GifFile,
                     const GifByteType *GifCodeBlock);
 
+/* Lossy LZ compression and deferred clear codes, see egif_lib.c */
+int EGifSetLossyError(GifFileType *GifFile, const int GifMaxError);
+int EGifSetClearThreshold(GifFileType *GifFile, const int GifThreshold);
+int EGifSetTransparentIndex(GifFileType *GifFile, const int GifTransparentIndex);
+
 /******************************************************************************
  GIF decoding routines
 ******************************************************************************/
@@ -17,6 +17,10 @@ gif_lib_private.h - internal giflib routines and structures
 #define LZ_MAX_CODE         4095    /* Biggest code possible in 12 bits. */
 #define LZ_BITS             12
 
+#define LOSSY_MAX_NEIGHBORS 32      /* Colors a lossy match may try per pixel. */
+#define CLEAR_WINDOW_BITS   12288   /* Output a full table is judged over. */
+#define CLEAR_MAX_FROZEN_CODES 4096 /* Most codes output from a full table. */
+
 #define FLUSH_OUTPUT        4096    /* Impossible code, to signal flush. */
 #define FIRST_CODE          4097    /* Impossible code, to signal first. */
 #define NO_SUCH_CODE        4098    /* Impossible code, to signal empty. */
@@ -51,6 +55,16 @@ typedef struct GifFilePrivateType {
     GifByteType Suffix[LZ_MAX_CODE + 1];    /* So we can trace the codes. */
     GifPrefixType Prefix[LZ_MAX_CODE + 1];
     GifHashTableType *HashTable;
+    int LossyError;     /* Max. color distance of a lossy match, 0 if off. */
+    int TransparentIndex;   /* From the last graphics control extension. */
+    GifByteType *LossyNeighbors;    /* Close colors of each color, by distance. */
+    GifByteType LossyNeighborCount[256];
+    int ClearThreshold; /* % a full table may degrade before clear, 0: never. */
+    unsigned long CodeBits, CodePixels; /* Since clear, or the window start. */
+    unsigned long BaseBits, BasePixels; /* Best of the fill and the windows. */
+    unsigned long FrozenCodes;  /* Output since the table filled up. */
+    int CrntRunPixel;   /* If CrntCode is a run of one pixel, that pixel. */
+    unsigned short RunNext[LZ_MAX_CODE + 1];    /* Run code -> one longer run. */
     bool gif89;
 } GifFilePrivateType;
 
@@ -23,23 +23,66 @@ AnimatedGif::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "end", End);
     NODE_SET_PROTOTYPE_METHOD(t, "setOutputFile", SetOutputFile);
     NODE_SET_PROTOTYPE_METHOD(t, "setOutputCallback", SetOutputCallback);
+    NODE_SET_PROTOTYPE_METHOD(t, "setMemoryOutput", SetMemoryOutput);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSharedFileWriter", SetSharedFileWriter);
+    NODE_SET_PROTOTYPE_METHOD(t, "setMappedFile", SetMappedFile);
+    NODE_SET_PROTOTYPE_METHOD(t, "setDeltaTransparency", SetDeltaTransparency);
+    NODE_SET_PROTOTYPE_METHOD(t, "setFrameImages", SetFrameImages);
+    NODE_SET_PROTOTYPE_METHOD(t, "setPersistentCanvas", SetPersistentCanvas);
+    NODE_SET_PROTOTYPE_METHOD(t, "setFrameThreads", SetFrameThreads);
+    NODE_SET_PROTOTYPE_METHOD(t, "setEncoderThread", SetEncoderThread);
+    NODE_SET_PROTOTYPE_METHOD(t, "setDropFrames", SetDropFrames);
+    NODE_SET_PROTOTYPE_METHOD(t, "getDroppedFrames", GetDroppedFrames);
+    NODE_SET_PROTOTYPE_METHOD(t, "setFrameCallback", SetFrameCallback);
+    NODE_SET_PROTOTYPE_METHOD(t, "setBroadcast", SetBroadcast);
+    NODE_SET_PROTOTYPE_METHOD(t, "subscribe", Subscribe);
+    NODE_SET_PROTOTYPE_METHOD(t, "unsubscribe", Unsubscribe);
+    NODE_SET_PROTOTYPE_METHOD(t, "setLossy", SetLossy);
+    NODE_SET_PROTOTYPE_METHOD(t, "setClearThreshold", SetClearThreshold);
     target->Set(String::NewSymbol("AnimatedGif"), t->GetFunction());
 }
 
 AnimatedGif::AnimatedGif(int wwidth, int hheight, buffer_type bbuf_type) :
     width(wwidth), height(hheight), buf_type(bbuf_type),
-    gif_encoder(wwidth, hheight, BUF_RGB), transparency_color(0xFF, 0xFF, 0xFE),
-    data(NULL)
+    gif_encoder(wwidth, hheight, BUF_RGB),
+    transparency_color(0xFF, 0xFF, 0xFE), data(NULL),
+    canvases(wwidth*hheight*3), persistent_canvas(false),
+    queue_length(0), frames(NULL), ending(false), end_pending(false),
+    events_async(NULL), queued_frames(0),
+    drop_behind(0), held(NULL), dropped_frames(0)
 {
     gif_encoder.set_transparency_color(transparency_color);
 }
 
+AnimatedGif::~AnimatedGif()
+{
+    // dropped without end(), so nothing is queued for the encoder thread
+    if (frames) {
+        ending = true;
+        frames->push(NULL);
+        uv_thread_join(&encoder_thread);
+        FinishEvents(false);
+    }
+    free(data);
+    if (!gif_buffer.IsEmpty())
+        gif_buffer.Dispose();
+    if (held) {
+        for (size_t i = 0; i < held->callbacks.size(); i++)
+            held->callbacks[i].Dispose();
+        delete held;
+    }
+    for (GifSubscribers::iterator it = subscribers.begin(); it != subscribers.end(); ++it) {
+        it->second->callback.Dispose();
+        delete it->second;
+    }
+}
+
 Handle<Value>
 AnimatedGif::Push(unsigned char *data_buf, int x, int y, int w, int h)
 {
     if (!data) {
-        data = (unsigned char *)malloc(sizeof(*data)*width*height*3);
-        if (!data) throw "malloc in AnimatedGif::Push failed";
+        data = canvases.get();
+        if (!data) throw "allocating a canvas in AnimatedGif::Push failed";
 
         unsigned char *datap = data;
         for (int i = 0; i < width*height; i++) {
@@ -49,6 +92,9 @@ AnimatedGif::Push(unsigned char *data_buf, int x, int y, int w, int h)
         }
     }
 
+    if (w > 0 && h > 0)
+        pushed.push_back(Rect(x, y, w, h));
+
     int start = y*width*3 + x*3;
 
     unsigned char *data_bufp = data_buf;
@@ -79,11 +125,17 @@ AnimatedGif::Push(unsigned char *data_buf, int x, int y, int w, int h)
 }
 
 void
-AnimatedGif::EndPush()
+AnimatedGif::EndPush(int delay)
 {
-    gif_encoder.new_frame(data);
-    free(data);
-    data = NULL;
+    // nothing but the pushed rectangles can have changed
+    gif_encoder.new_frame(data, delay, pushed);
+    pushed.clear();
+    // a persistent canvas stays as the pushes left it, the encoder only
+    // encodes what the next pushes change
+    if (!persistent_canvas) {
+        canvases.put(data);
+        data = NULL;
+    }
 }
 
 Handle<Value>
@@ -191,9 +243,38 @@ AnimatedGif::EndPush(const Arguments &args)
 {
     HandleScope scope;
 
+    int delay = 0, arg = 0;
+    if (args.Length() > 0 && args[0]->IsInt32()) {
+        delay = args[0]->Int32Value();
+        if (delay < 0 || delay > 0xffff)
+            return VException("Delay must be between 0 and 65535.");
+        arg = 1;
+    }
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::EndPush before the end callback.");
+    if (gif->ending)
+        return VException("AnimatedGif::EndPush after end.");
+    if (gif->queue_length > 0) {
+        if (args.Length() > arg && !args[arg]->IsFunction())
+            return VException("Callback must be a function.");
+        if (!gif->encoder_error.empty()) {
+            std::string err = gif->encoder_error;
+            gif->encoder_error.clear();
+            return VException(err.c_str());
+        }
+        try {
+            bool more = gif->QueueFrame(args.Length() > arg ? args[arg] : Handle<Value>(), delay);
+            return scope.Close(Boolean::New(more));
+        }
+        catch (const char *err) {
+            return VException(err);
+        }
+    }
+
     try {
-        AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
-        gif->EndPush();
+        gif->EndPush(delay);
     }
     catch (const char *err) {
         return VException(err);
@@ -208,10 +289,20 @@ AnimatedGif::GetGif(const Arguments &args)
     HandleScope scope;
 
     AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::GetGif before the end callback.");
+    // the encoder's memory went to the first Buffer, later calls get it too
+    if (!gif->gif_buffer.IsEmpty())
+        return scope.Close(gif->gif_buffer);
+    if (gif->HasEncoderThread() && !gif->ending) {
+        const char *error = gif->StopEncoder();
+        if (error)
+            return VException(error);
+    }
     gif->gif_encoder.finish();
     int gif_len = gif->gif_encoder.get_gif_len();
-    Buffer *retbuf = Buffer::New(gif_len);
-    memcpy(BufferData(retbuf), gif->gif_encoder.get_gif(), gif_len);
+    Buffer *retbuf = BufferAdopt((char *)gif->gif_encoder.release_gif(), gif_len);
+    gif->gif_buffer = Persistent<Object>::New(retbuf->handle_);
     return scope.Close(retbuf->handle_);
 }
 
@@ -221,26 +312,160 @@ AnimatedGif::End(const Arguments &args)
     HandleScope scope;
 
     AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
-    gif->gif_encoder.finish();
+    if (gif->end_pending)
+        return VException("AnimatedGif::End before the end callback.");
+    bool threaded = gif->HasEncoderThread() && !gif->ending;
+
+    if (args.Length() == 0) {
+        if (threaded) {
+            const char *error = gif->StopEncoder();
+            if (error)
+                return VException(error);
+            return Undefined();
+        }
+        try {
+            gif->gif_encoder.finish();
+        }
+        catch (const char *err) {
+            return VException(err);
+        }
+        return Undefined();
+    }
+
+    if (!args[0]->IsFunction())
+        return VException("First argument must be a function.");
+
+    // the output file is closed and synced in the thread pool, the callback
+    // gets called once it's all on disk. The encoder thread is told to stop
+    // after the queued frames, the encoder is finished once it has. Either
+    // way no more frames can come, they'd reopen the file.
+    if (threaded) {
+        try {
+            gif->SendDropped();
+        }
+        catch (const char *err) {
+            return VException(err);
+        }
+        gif->ending = true;
+        gif->frames->push(NULL);
+    }
+    else {
+        try {
+            gif->gif_encoder.finish(false);
+        }
+        catch (const char *err) {
+            return VException(err);
+        }
+        gif->ending = true;
+    }
+
+    encode_request *enc_req = (encode_request *)malloc(sizeof(*enc_req));
+    if (!enc_req)
+        return VException("malloc in AnimatedGif::End failed.");
+
+    enc_req->callback = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+    enc_req->gif_obj = gif;
+    enc_req->gif = NULL;
+    enc_req->gif_len = 0;
+    enc_req->error = NULL;
+    enc_req->buf_data = NULL;
+
+    uv_work_t *req = new uv_work_t;
+    req->data = enc_req;
+    uv_queue_work(uv_default_loop(), req, EIO_End, EIO_EndAfter);
+
+    gif->end_pending = true;
+    gif->Ref();
 
     return Undefined();
 }
 
+void
+AnimatedGif::EIO_End(uv_work_t *req)
+{
+    encode_request *enc_req = (encode_request *)req->data;
+    AnimatedGif *gif = (AnimatedGif *)enc_req->gif_obj;
+
+    if (gif->HasEncoderThread()) {
+        uv_thread_join(&gif->encoder_thread);
+        uv_mutex_lock(&gif->encoder_lock);
+        try {
+            gif->gif_encoder.finish(false);
+        }
+        catch (const char *err) {
+            enc_req->error = strdup(err);
+        }
+        uv_mutex_unlock(&gif->encoder_lock);
+    }
+
+    if (!gif->gif_encoder.close_file() && !enc_req->error)
+        enc_req->error = strdup(gif->gif_encoder.get_file_error());
+}
+
+void
+AnimatedGif::EIO_EndAfter(uv_work_t *req, int status)
+{
+    HandleScope scope;
+
+    encode_request *enc_req = (encode_request *)req->data;
+    AnimatedGif *gif = (AnimatedGif *)enc_req->gif_obj;
+    if (gif->HasEncoderThread()) {
+        gif->FinishEvents();
+        if (!enc_req->error && !gif->encoder_error.empty())
+            enc_req->error = strdup(gif->encoder_error.c_str());
+    }
+
+    Handle<Value> argv[1];
+    if (enc_req->error)
+        argv[0] = ErrorException(enc_req->error);
+    else
+        argv[0] = Undefined();
+
+    // the callback may get the gif already
+    gif->end_pending = false;
+
+    TryCatch try_catch;
+
+    enc_req->callback->Call(Context::GetCurrent()->Global(), 1, argv);
+
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    enc_req->callback.Dispose();
+    free(enc_req->error);
+
+    gif->Unref();
+    free(enc_req);
+    delete req;
+}
+
 Handle<Value>
 AnimatedGif::SetOutputFile(const Arguments &args)
 {
     HandleScope scope;
 
-    if (args.Length() != 1)
-        return VException("One argument required - path to output file.");
+    if (args.Length() < 1)
+        return VException("At least one argument required - path to output file, [and path to frame index file].");
 
     if (!args[0]->IsString())
         return VException("First argument must be string.");
+    if (args.Length() > 1 && !args[1]->IsString())
+        return VException("Second argument must be string.");
 
     String::AsciiValue file_name(args[0]->ToString());
 
     AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
-    gif->gif_encoder.set_output_file(*file_name);
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetOutputFile before the end callback.");
+    gif->LockEncoder();
+    if (args.Length() > 1) {
+        String::AsciiValue index_file_name(args[1]->ToString());
+        gif->gif_encoder.set_output_file(*file_name, *index_file_name);
+    }
+    else {
+        gif->gif_encoder.set_output_file(*file_name);
+    }
+    gif->UnlockEncoder();
 
     return Undefined();
 }
@@ -248,9 +473,14 @@ AnimatedGif::SetOutputFile(const Arguments &args)
 int
 stream_writer(GifFileType *gif_file, const GifByteType *data, int size)
 {
+    // on the encoder thread (or the thread pool, at the end) V8 is off
+    // limits, the data goes to the JS thread as an event
+    AnimatedGif *gif = (AnimatedGif *)gif_file->UserData;
+    if (gif->HasEncoderThread())
+        return gif->QueueData(NULL, data, size) ? size : 0;
+
     HandleScope scope;
 
-    AnimatedGif *gif = (AnimatedGif *)gif_file->UserData;
     Buffer *retbuf = Buffer::New(size);
     memcpy(BufferData(retbuf), data, size);
     Handle<Value> argv[1] = {
@@ -268,15 +498,754 @@ AnimatedGif::SetOutputCallback(const Arguments &args)
 {
     HandleScope scope;
 
-    if (args.Length() != 1)
-        return VException("One argument required - path to output file.");
+    if (args.Length() < 1)
+        return VException("At least one argument required - callback function, [and high water mark].");
 
     if (!args[0]->IsFunction())
-        return VException("First argument must be string.");
+        return VException("First argument must be function.");
+
+    int high_water = 64*1024;
+    if (args.Length() > 1) {
+        if (!args[1]->IsInt32())
+            return VException("Second argument must be integer high water mark.");
+        high_water = args[1]->Int32Value();
+        if (high_water < 0)
+            return VException("High water mark smaller than 0.");
+    }
 
     Local<Function> callback = Local<Function>::Cast(args[0]);
     AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetOutputCallback before the end callback.");
     gif->ondata = Persistent<Function>::New(callback);
-    gif->gif_encoder.set_output_func(stream_writer, (void*)gif);
+    gif->LockEncoder();
+    gif->gif_encoder.set_output_func(stream_writer, (void*)gif, high_water);
+    gif->UnlockEncoder();
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetMemoryOutput(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetMemoryOutput before the end callback.");
+    gif->LockEncoder();
+    gif->gif_encoder.set_memory_output(args[0]->BooleanValue());
+    gif->UnlockEncoder();
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetSharedFileWriter(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetSharedFileWriter before the end callback.");
+    gif->LockEncoder();
+    gif->gif_encoder.set_shared_file_writer(args[0]->BooleanValue());
+    gif->UnlockEncoder();
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetMappedFile(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetMappedFile before the end callback.");
+    gif->LockEncoder();
+    gif->gif_encoder.set_mapped_file(args[0]->BooleanValue());
+    gif->UnlockEncoder();
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetDeltaTransparency(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetDeltaTransparency before the end callback.");
+    gif->LockEncoder();
+    gif->gif_encoder.set_delta_transparency(args[0]->BooleanValue());
+    gif->UnlockEncoder();
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetFrameImages(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - maximum images per frame.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer maximum images per frame.");
+
+    int images = args[0]->Int32Value();
+    if (images < 1)
+        return VException("Maximum images per frame smaller than 1.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetFrameImages before the end callback.");
+    gif->LockEncoder();
+    gif->gif_encoder.set_max_images(images);
+    gif->UnlockEncoder();
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetPersistentCanvas(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetPersistentCanvas before the end callback.");
+    gif->persistent_canvas = args[0]->BooleanValue();
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetFrameThreads(const Arguments &args)
+{
+    HandleScope scope;
+
+    int threads = 0;
+    if (args.Length() >= 1) {
+        if (!args[0]->IsInt32())
+            return VException("First argument must be integer number of threads.");
+        threads = args[0]->Int32Value();
+    }
+    if (threads < 0)
+        return VException("Number of threads smaller than 0.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetFrameThreads before the end callback.");
+    gif->LockEncoder();
+    gif->gif_encoder.set_frame_threads(threads);
+    gif->UnlockEncoder();
+
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetEncoderThread(const Arguments &args)
+{
+    HandleScope scope;
+
+    int queue_length = 4;
+    if (args.Length() >= 1) {
+        if (!args[0]->IsInt32())
+            return VException("First argument must be integer queue length.");
+        queue_length = args[0]->Int32Value();
+    }
+    if (queue_length < 1)
+        return VException("Queue length smaller than 1.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetEncoderThread before the end callback.");
+    if (gif->HasEncoderThread())
+        return VException("The encoder thread is already running.");
+    gif->queue_length = queue_length;
+
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetDropFrames(const Arguments &args)
+{
+    HandleScope scope;
+
+    int behind = 2;
+    if (args.Length() >= 1) {
+        if (!args[0]->IsInt32())
+            return VException("First argument must be integer number of frames.");
+        behind = args[0]->Int32Value();
+    }
+    if (behind < 0)
+        return VException("Number of frames smaller than 0.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetDropFrames before the end callback.");
+    gif->drop_behind = behind;
+
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::GetDroppedFrames(const Arguments &args)
+{
+    HandleScope scope;
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    return scope.Close(Integer::New(gif->dropped_frames));
+}
+
+static void
+notify_frame(AnimatedGif *gif, const FrameInfo &frame)
+{
+    HandleScope scope;
+
+    Handle<Value> argv[4] = {
+      Integer::New(frame.frame),
+      Number::New(frame.offset),
+      Integer::New(frame.length),
+      Integer::New(frame.delay)
+    };
+    gif->onframe->Call(Context::GetCurrent()->Global(), 4, argv);
+}
+
+static void
+frame_notifier(void *user_data, const FrameInfo &frame)
+{
+    AnimatedGif *gif = (AnimatedGif *)user_data;
+    if (gif->HasEncoderThread()) {
+        GifEvent event;
+        event.type = GifEvent::FRAME_INFO;
+        event.info = frame;
+        gif->QueueEvent(event);
+        return;
+    }
+    notify_frame(gif, frame);
+}
+
+Handle<Value>
+AnimatedGif::SetFrameCallback(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - callback function.");
+
+    if (!args[0]->IsFunction())
+        return VException("First argument must be function.");
+
+    Local<Function> callback = Local<Function>::Cast(args[0]);
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetFrameCallback before the end callback.");
+    gif->onframe = Persistent<Function>::New(callback);
+    gif->LockEncoder();
+    gif->gif_encoder.set_frame_func(frame_notifier, (void*)gif);
+    gif->UnlockEncoder();
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetBroadcast(const Arguments &args)
+{
+    HandleScope scope;
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetBroadcast before the end callback.");
+    gif->LockEncoder();
+    try {
+        gif->gif_encoder.set_broadcast();
+    }
+    catch (const char *err) {
+        gif->UnlockEncoder();
+        return VException(err);
+    }
+    gif->UnlockEncoder();
+
+    return Undefined();
+}
+
+static int
+subscriber_writer(GifFileType *gif_file, const GifByteType *data, int size)
+{
+    GifSubscriber *subscriber = (GifSubscriber *)gif_file->UserData;
+    if (subscriber->gif->HasEncoderThread())
+        return subscriber->gif->QueueData(subscriber, data, size) ? size : 0;
+
+    HandleScope scope;
+
+    Buffer *retbuf = Buffer::New(size);
+    memcpy(BufferData(retbuf), data, size);
+    Handle<Value> argv[1] = {
+      retbuf->handle_
+    };
+    subscriber->callback->Call(Context::GetCurrent()->Global(), 1, argv);
+    return size;
+}
+
+Handle<Value>
+AnimatedGif::Subscribe(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1)
+        return VException("At least one argument required - callback function, [and high water mark].");
+
+    if (!args[0]->IsFunction())
+        return VException("First argument must be function.");
+
+    int high_water = 64*1024;
+    if (args.Length() > 1) {
+        if (!args[1]->IsInt32())
+            return VException("Second argument must be integer high water mark.");
+        high_water = args[1]->Int32Value();
+        if (high_water < 0)
+            return VException("High water mark smaller than 0.");
+    }
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    GifSubscriber *subscriber = new GifSubscriber;
+    subscriber->callback = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+    subscriber->gif = gif;
+    subscriber->active = true;
+
+    bool threaded = gif->HasEncoderThread();
+    if (threaded)
+        uv_mutex_lock(&gif->encoder_lock);
+    try {
+        int id = gif->gif_encoder.subscribe(subscriber_writer, subscriber, high_water);
+        if (threaded)
+            uv_mutex_unlock(&gif->encoder_lock);
+        gif->subscribers[id] = subscriber;
+        return scope.Close(Integer::New(id));
+    }
+    catch (const char *err) {
+        if (threaded)
+            uv_mutex_unlock(&gif->encoder_lock);
+        subscriber->callback.Dispose();
+        delete subscriber;
+        return VException(err);
+    }
+}
+
+Handle<Value>
+AnimatedGif::Unsubscribe(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - subscriber id.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer subscriber id.");
+
+    int id = args[0]->Int32Value();
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    GifSubscribers::iterator it = gif->subscribers.find(id);
+    if (it == gif->subscribers.end())
+        return VException("No subscriber with this id.");
+
+    if (gif->HasEncoderThread()) {
+        // output for it may still be queued, it goes after that
+        uv_mutex_lock(&gif->encoder_lock);
+        gif->gif_encoder.unsubscribe(id);
+        uv_mutex_unlock(&gif->encoder_lock);
+        it->second->active = false;
+        GifEvent event;
+        event.type = GifEvent::SUBSCRIBER_GONE;
+        event.subscriber = it->second;
+        gif->QueueEvent(event);
+    }
+    else {
+        gif->gif_encoder.unsubscribe(id);
+        it->second->callback.Dispose();
+        delete it->second;
+    }
+    gif->subscribers.erase(it);
+
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetLossy(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - maximum color error.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer maximum color error.");
+
+    int error = args[0]->Int32Value();
+    if (error < 0)
+        return VException("Maximum color error smaller than 0.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetLossy before the end callback.");
+    gif->LockEncoder();
+    gif->gif_encoder.set_lossy(error);
+    gif->UnlockEncoder();
+
+    return Undefined();
+}
+
+Handle<Value>
+AnimatedGif::SetClearThreshold(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - threshold in percent.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer threshold in percent.");
+
+    int threshold = args[0]->Int32Value();
+    if (threshold < 0)
+        return VException("Threshold smaller than 0.");
+
+    AnimatedGif *gif = ObjectWrap::Unwrap<AnimatedGif>(args.This());
+    if (gif->end_pending)
+        return VException("AnimatedGif::SetClearThreshold before the end callback.");
+    gif->LockEncoder();
+    gif->gif_encoder.set_clear_threshold(threshold);
+    gif->UnlockEncoder();
+
     return Undefined();
 }
+
+// Hands the frame to the encoder thread, waiting while the queue is full.
+// Returns whether there's room for another one.
+bool
+AnimatedGif::QueueFrame(Handle<Value> callback, int delay)
+{
+    if (!frames)
+        StartEncoder();
+
+    bool drop = drop_behind > 0 && frames->size() >= (unsigned)drop_behind;
+    // the frames dropped before this one show for as long as they would
+    // have, as part of it - unless that's more than a gif delay holds
+    if (held && held->delay + delay > 0xffff) {
+        SendFrame();
+        drop = false;
+    }
+    if (!held) {
+        held = new QueuedFrame;
+        held->data = NULL;
+        held->delay = 0;
+        held->error = NULL;
+    }
+    held->delay += delay;
+    if (!callback.IsEmpty() && callback->IsFunction())
+        held->callbacks.push_back(Persistent<Function>::New(Handle<Function>::Cast(callback)));
+
+    if (drop) {
+        dropped_frames++;
+        return !frames->full();
+    }
+    return SendFrame();
+}
+
+// queues the frames dropped since the last one, before the end
+void
+AnimatedGif::SendDropped()
+{
+    if (held)
+        SendFrame();
+}
+
+bool
+AnimatedGif::SendFrame()
+{
+    // the thread encodes the frame while the next one is being pushed, so
+    // a persistent canvas is copied
+    if (persistent_canvas && data) {
+        held->data = canvases.get();
+        if (!held->data)
+            throw "allocating a canvas in AnimatedGif::EndPush failed";
+        memcpy(held->data, data, width*height*3);
+    }
+    else {
+        held->data = data;
+        data = NULL;
+    }
+    held->pushed.swap(pushed);
+
+    // referenced until the frame's done, so that its callback gets called
+    if (queued_frames++ == 0) {
+        Ref();
+        uv_ref((uv_handle_t *)events_async);
+    }
+    frames->push(held);
+    held = NULL;
+    return !frames->full();
+}
+
+void
+AnimatedGif::StartEncoder()
+{
+    uv_mutex_init(&encoder_lock);
+    uv_mutex_init(&events_lock);
+    events_async = new uv_async_t;
+    uv_async_init(uv_default_loop(), events_async, EventsReady);
+    events_async->data = this;
+    uv_unref((uv_handle_t *)events_async);
+    frames = new SpscQueue<QueuedFrame *>(queue_length);
+
+    if (uv_thread_create(&encoder_thread, EncoderThread, this) != 0) {
+        FinishEvents();
+        throw "starting the encoder thread in AnimatedGif::EndPush failed";
+    }
+}
+
+// The setters change gif_encoder while the encoder thread may be in the
+// middle of a frame.
+void
+AnimatedGif::LockEncoder()
+{
+    if (HasEncoderThread())
+        uv_mutex_lock(&encoder_lock);
+}
+
+void
+AnimatedGif::UnlockEncoder()
+{
+    if (HasEncoderThread())
+        uv_mutex_unlock(&encoder_lock);
+}
+
+// Lets the encoder thread get through the queued frames, finishes the gif
+// and delivers what's left. Returns the first error, if any.
+const char *
+AnimatedGif::StopEncoder()
+{
+    const char *error = NULL;
+    try {
+        SendDropped();
+    }
+    catch (const char *err) {
+        error = err;
+    }
+    ending = true;
+    frames->push(NULL);
+    uv_thread_join(&encoder_thread);
+
+    try {
+        gif_encoder.finish();
+    }
+    catch (const char *err) {
+        if (!error)
+            error = err;
+    }
+    FinishEvents();
+    if (!error && !encoder_error.empty())
+        error = encoder_error.c_str();
+    return error;
+}
+
+// Delivers or, when the object is going away, just frees what's left of
+// the events and closes the handle.
+void
+AnimatedGif::FinishEvents(bool deliver)
+{
+    if (deliver) {
+        DeliverEvents();
+    }
+    else {
+        for (size_t i = 0; i < events.size(); i++) {
+            GifEvent &event = events[i];
+            switch (event.type) {
+            case GifEvent::DATA:
+                free(event.data);
+                break;
+            case GifEvent::FRAME_DONE:
+                for (size_t j = 0; j < event.frame->callbacks.size(); j++)
+                    event.frame->callbacks[j].Dispose();
+                delete event.frame;
+                break;
+            case GifEvent::SUBSCRIBER_GONE:
+                event.subscriber->callback.Dispose();
+                delete event.subscriber;
+                break;
+            default:
+                break;
+            }
+        }
+        events.clear();
+    }
+    events_async->data = NULL;
+    uv_close((uv_handle_t *)events_async, EventsClosed);
+    events_async = NULL;
+    delete frames;
+    frames = NULL;
+    uv_mutex_destroy(&events_lock);
+    uv_mutex_destroy(&encoder_lock);
+}
+
+void
+AnimatedGif::EncoderThread(void *arg)
+{
+    AnimatedGif *gif = (AnimatedGif *)arg;
+
+    for (;;) {
+        QueuedFrame *frame = gif->frames->pop();
+        if (!frame)
+            break;
+
+        uv_mutex_lock(&gif->encoder_lock);
+        try {
+            gif->gif_encoder.new_frame(frame->data, frame->delay, frame->pushed);
+        }
+        catch (const char *err) {
+            frame->error = err;
+        }
+        uv_mutex_unlock(&gif->encoder_lock);
+        gif->canvases.put(frame->data);
+        frame->data = NULL;
+
+        GifEvent event;
+        event.type = GifEvent::FRAME_DONE;
+        event.frame = frame;
+        gif->QueueEvent(event);
+    }
+}
+
+void
+AnimatedGif::QueueEvent(const GifEvent &event)
+{
+    uv_mutex_lock(&events_lock);
+    events.push_back(event);
+    uv_mutex_unlock(&events_lock);
+    uv_async_send(events_async);
+}
+
+bool
+AnimatedGif::QueueData(GifSubscriber *subscriber, const unsigned char *data, int size)
+{
+    GifEvent event;
+    event.type = GifEvent::DATA;
+    event.subscriber = subscriber;
+    event.data = (char *)malloc(size);
+    if (!event.data)
+        return false;
+    memcpy(event.data, data, size);
+    event.size = size;
+    QueueEvent(event);
+    return true;
+}
+
+void
+AnimatedGif::DeliverEvents()
+{
+    HandleScope scope;
+
+    std::deque<GifEvent> ready;
+    uv_mutex_lock(&events_lock);
+    ready.swap(events);
+    uv_mutex_unlock(&events_lock);
+
+    int done = 0;
+    for (size_t i = 0; i < ready.size(); i++) {
+        GifEvent &event = ready[i];
+        TryCatch try_catch;
+
+        switch (event.type) {
+        case GifEvent::DATA: {
+            if (event.subscriber && !event.subscriber->active) {
+                free(event.data);
+                break;
+            }
+            Buffer *buf = BufferAdopt(event.data, event.size);
+            Handle<Value> argv[1] = {
+              buf->handle_
+            };
+            Persistent<Function> &callback =
+                event.subscriber ? event.subscriber->callback : ondata;
+            callback->Call(Context::GetCurrent()->Global(), 1, argv);
+            break;
+        }
+        case GifEvent::FRAME_INFO:
+            notify_frame(this, event.info);
+            break;
+        case GifEvent::FRAME_DONE: {
+            QueuedFrame *frame = event.frame;
+            Handle<Value> argv[1];
+            if (frame->error)
+                argv[0] = ErrorException(frame->error);
+            else
+                argv[0] = Undefined();
+            for (size_t j = 0; j < frame->callbacks.size(); j++) {
+                frame->callbacks[j]->Call(Context::GetCurrent()->Global(), 1, argv);
+                frame->callbacks[j].Dispose();
+            }
+            if (frame->callbacks.empty() && frame->error && encoder_error.empty())
+                encoder_error = frame->error;
+            delete frame;
+            done++;
+            break;
+        }
+        case GifEvent::SUBSCRIBER_GONE:
+            event.subscriber->callback.Dispose();
+            delete event.subscriber;
+            break;
+        }
+
+        if (try_catch.HasCaught())
+            FatalException(try_catch);
+    }
+
+    // only once nothing is left to do with this object
+    if (done > 0) {
+        queued_frames -= done;
+        if (queued_frames == 0) {
+            if (events_async)
+                uv_unref((uv_handle_t *)events_async);
+            Unref();
+        }
+    }
+}
+
+void
+AnimatedGif::EventsReady(uv_async_t *handle, int status)
+{
+    ((AnimatedGif *)handle->data)->DeliverEvents();
+}
+
+void
+AnimatedGif::EventsClosed(uv_handle_t *handle)
+{
+    delete (uv_async_t *)handle;
+}
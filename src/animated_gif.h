@@ -4,26 +4,117 @@
 #include <node.h>
 #include <node_buffer.h>
 
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
 #include "gif_encoder.h"
 #include "common.h"
+#include "buffer_pool.h"
+#include "spsc_queue.h"
+
+class AnimatedGif;
+
+struct GifSubscriber {
+    v8::Persistent<v8::Function> callback;
+    AnimatedGif *gif;
+    bool active; // false once unsubscribed
+};
+
+// a frame on its way to the encoder thread, with the callbacks of the
+// frames that were dropped into it
+struct QueuedFrame {
+    unsigned char *data;
+    std::vector<Rect> pushed;
+    int delay;
+    std::vector<v8::Persistent<v8::Function> > callbacks;
+    const char *error;
+};
+
+// What the encoder thread has for the JS thread: output for ondata (no
+// subscriber) or a subscriber, a frame written out, a frame encoded or a
+// subscriber that can go now that nothing is queued for it any more.
+struct GifEvent {
+    enum { DATA, FRAME_INFO, FRAME_DONE, SUBSCRIBER_GONE } type;
+    GifSubscriber *subscriber;
+    char *data;
+    int size;
+    FrameInfo info;
+    QueuedFrame *frame;
+};
 
 class AnimatedGif : public node::ObjectWrap {
     int width, height;
     buffer_type buf_type;
 
     AnimatedGifEncoder gif_encoder;
+    v8::Persistent<v8::Object> gif_buffer; // getGif() took the encoder's memory
     unsigned char *data;
+    BufferPool canvases; // for data, handed back once a frame is encoded
+    bool persistent_canvas; // keep data from frame to frame
+    std::vector<Rect> pushed; // since the last frame
     Color transparency_color;
 
+    typedef std::map<int, GifSubscriber *> GifSubscribers;
+    GifSubscribers subscribers;
+
+    // With an encoder thread endPush() only queues the frame. All output
+    // that has to go to JS comes back as events, which are delivered on
+    // the JS thread.
+    int queue_length; // 0 for no encoder thread
+    SpscQueue<QueuedFrame *> *frames;
+    uv_thread_t encoder_thread;
+    uv_mutex_t encoder_lock; // gif_encoder, while the thread runs
+    bool ending;
+    bool end_pending; // end() with a callback that hasn't been called yet
+    uv_mutex_t events_lock;
+    std::deque<GifEvent> events;
+    // Neither the handle nor the thread keep the loop or the object alive
+    // while no frames are queued; the handle is freed once it's closed.
+    uv_async_t *events_async;
+    int queued_frames; // whose FRAME_DONE hasn't been delivered yet
+    std::string encoder_error; // of a frame without a callback
+
+    // While drop_behind or more frames wait for the encoder thread, endPush()
+    // drops its frame: the pushes stay on the canvas, the delay and the
+    // callback go to held, which is queued by the next endPush() that
+    // finds the thread caught up.
+    int drop_behind; // 0 to never drop
+    QueuedFrame *held;
+    int dropped_frames;
+
+    void StartEncoder();
+    void LockEncoder();
+    void UnlockEncoder();
+    bool SendFrame();
+    const char *StopEncoder();
+    void FinishEvents(bool deliver=true);
+    void DeliverEvents();
+    static void EncoderThread(void *arg);
+    static void EventsReady(uv_async_t *handle, int status);
+    static void EventsClosed(uv_handle_t *handle);
+
+    static void EIO_End(uv_work_t *req);
+    static void EIO_EndAfter(uv_work_t *req, int status);
+
 public:
 
     v8::Persistent<v8::Function> ondata;
+    v8::Persistent<v8::Function> onframe;
 
     static void Initialize(v8::Handle<v8::Object> target);
 
     AnimatedGif(int wwidth, int hheight, buffer_type bbuf_type);
+    ~AnimatedGif();
     v8::Handle<v8::Value> Push(unsigned char *data_buf, int x, int y, int w, int h);
-    void EndPush();
+    void EndPush(int delay);
+    bool QueueFrame(v8::Handle<v8::Value> callback, int delay);
+    void SendDropped();
+
+    bool HasEncoderThread() const { return frames != NULL; }
+    void QueueEvent(const GifEvent &event);
+    bool QueueData(GifSubscriber *subscriber, const unsigned char *data, int size);
 
     static v8::Handle<v8::Value> New(const v8::Arguments &args);
     static v8::Handle<v8::Value> Push(const v8::Arguments &args);
@@ -32,6 +123,22 @@ public:
     static v8::Handle<v8::Value> GetGif(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetOutputFile(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetOutputCallback(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetMemoryOutput(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetSharedFileWriter(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetMappedFile(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetDeltaTransparency(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetFrameImages(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetPersistentCanvas(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetFrameThreads(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetEncoderThread(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetDropFrames(const v8::Arguments &args);
+    static v8::Handle<v8::Value> GetDroppedFrames(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetFrameCallback(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetBroadcast(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Subscribe(const v8::Arguments &args);
+    static v8::Handle<v8::Value> Unsubscribe(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetLossy(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetClearThreshold(const v8::Arguments &args);
 };
 
 #endif
@@ -1,11 +1,13 @@
 #include <cerrno>
 #include <cstdlib>
+#include <vector>
 
 #include "common.h"
 #include "utils.h"
 #include "gif_encoder.h"
 #include "async_animated_gif.h"
 #include "buffer_compat.h"
+#include "buffer_pool.h"
 
 #include "loki/ScopeGuard.h"
 
@@ -24,13 +26,19 @@ AsyncAnimatedGif::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "encode", Encode);
     NODE_SET_PROTOTYPE_METHOD(t, "setOutputFile", SetOutputFile);
     NODE_SET_PROTOTYPE_METHOD(t, "setTmpDir", SetTmpDir);
+    NODE_SET_PROTOTYPE_METHOD(t, "setSharedFileWriter", SetSharedFileWriter);
+    NODE_SET_PROTOTYPE_METHOD(t, "setMappedFile", SetMappedFile);
+    NODE_SET_PROTOTYPE_METHOD(t, "setDeltaTransparency", SetDeltaTransparency);
+    NODE_SET_PROTOTYPE_METHOD(t, "setFrameImages", SetFrameImages);
+    NODE_SET_PROTOTYPE_METHOD(t, "setFrameThreads", SetFrameThreads);
     target->Set(String::NewSymbol("AsyncAnimatedGif"), t->GetFunction());
 }
 
 AsyncAnimatedGif::AsyncAnimatedGif(int wwidth, int hheight, buffer_type bbuf_type) :
     width(wwidth), height(hheight), buf_type(bbuf_type),
     transparency_color(0xFF, 0xFF, 0xFE),
-    push_id(0), fragment_id(0) {}
+    push_id(0), fragment_id(0), shared_file_writer(false), mapped_file(false),
+    delta_transparency(false), frame_threads(-1), frame_images(1) {}
 
 void
 AsyncAnimatedGif::EIO_Push(uv_work_t *req)
@@ -132,8 +140,9 @@ AsyncAnimatedGif::Push(unsigned char *data_buf, int x, int y, int w, int h)
 }
 
 void
-AsyncAnimatedGif::EndPush()
+AsyncAnimatedGif::EndPush(int delay)
 {
+    delays.push_back(delay);
     push_id++;
     fragment_id = 0;
 }
@@ -244,8 +253,17 @@ AsyncAnimatedGif::EndPush(const Arguments &args)
 {
     HandleScope scope;
 
+    int delay = 0;
+    if (args.Length() > 0) {
+        if (!args[0]->IsInt32())
+            return VException("Delay must be an integer.");
+        delay = args[0]->Int32Value();
+        if (delay < 0 || delay > 0xffff)
+            return VException("Delay must be between 0 and 65535.");
+    }
+
     AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
-    gif->EndPush();
+    gif->EndPush(delay);
 
     return Undefined();
 }
@@ -261,20 +279,16 @@ fragment_sort(const void *aa, const void *bb)
     return na > nb;
 }
 
-unsigned char *
-AsyncAnimatedGif::init_frame(int width, int height, Color &transparency_color)
+void
+AsyncAnimatedGif::init_frame(unsigned char *frame, int width, int height,
+    Color &transparency_color)
 {
-    unsigned char *frame = (unsigned char *)malloc(sizeof(*frame)*width*height*3);
-    if (!frame) return NULL;
-
     unsigned char *framgep = frame;
     for (int i = 0; i < width*height; i++) {
         *framgep++ = transparency_color.r;
         *framgep++ = transparency_color.g;
         *framgep++ = transparency_color.b;
     }
-
-    return frame;
 }
 
 void
@@ -325,8 +339,18 @@ AsyncAnimatedGif::EIO_Encode(uv_work_t *req)
 
     AnimatedGifEncoder encoder(gif->width, gif->height, BUF_RGB);
     encoder.set_output_file(gif->output_file.c_str());
+    encoder.set_shared_file_writer(gif->shared_file_writer);
+    encoder.set_mapped_file(gif->mapped_file);
+    encoder.set_delta_transparency(gif->delta_transparency);
+    encoder.set_max_images(gif->frame_images);
+    encoder.set_frame_threads(gif->frame_threads);
     encoder.set_transparency_color(gif->transparency_color);
 
+    // every frame is built on the same canvas, and every fragment read into
+    // the same buffer, which only grows for fragments bigger than a frame
+    BufferPool frames(gif->width*gif->height*3, 1);
+    std::vector<unsigned char> data(gif->width*gif->height*3);
+
     for (size_t push_id = 0; push_id < gif->push_id; push_id++) {
         char fragment_path[512];
         snprintf(fragment_path, 512, "%s/%d", gif->tmp_dir.c_str(), push_id);
@@ -344,12 +368,13 @@ AsyncAnimatedGif::EIO_Encode(uv_work_t *req)
 
         qsort(fragments, nfragments, sizeof(char *), fragment_sort);
 
-        unsigned char *frame = init_frame(gif->width, gif->height, gif->transparency_color);
-        LOKI_ON_BLOCK_EXIT(free, frame);
+        unsigned char *frame = frames.get();
+        LOKI_ON_BLOCK_EXIT_OBJ(frames, &BufferPool::put, frame);
         if (!frame) {
             enc_req->error = strdup("malloc failed in AsyncAnimatedGif::EIO_Encode.");
             return;
         }
+        init_frame(frame, gif->width, gif->height, gif->transparency_color);
 
         for (int i = 0; i < nfragments; i++) {
             snprintf(fragment_path, 512, "%s/%d/%s",
@@ -364,9 +389,9 @@ AsyncAnimatedGif::EIO_Encode(uv_work_t *req)
             }
             LOKI_ON_BLOCK_EXIT(fclose, in);
             int size = file_size(fragment_path);
-            unsigned char *data = (unsigned char *)malloc(sizeof(*data)*size);
-            LOKI_ON_BLOCK_EXIT(free, data);
-            int read = fread(data, sizeof *data, size, in);
+            if (size > (int)data.size())
+                data.resize(size);
+            int read = fread(&data[0], sizeof data[0], size, in);
             if (read != size) {
                 char error[600];
                 snprintf(error, 600, "Error - should have read %d but read only %d from %s in AsyncAnimatedGif::EIO_Encode", size, read, fragment_path);
@@ -375,9 +400,9 @@ AsyncAnimatedGif::EIO_Encode(uv_work_t *req)
             }
             Rect dims = rect_dims(fragments[i]);
             push_fragment(frame, gif->width, gif->height, gif->buf_type,
-                data, dims.x, dims.y, dims.w, dims.h);
+                &data[0], dims.x, dims.y, dims.w, dims.h);
         }
-        encoder.new_frame(frame);
+        encoder.new_frame(frame, gif->delays[push_id]);
     }
     encoder.finish();
 
@@ -494,3 +519,94 @@ AsyncAnimatedGif::SetTmpDir(const Arguments &args)
     return Undefined();
 }
 
+Handle<Value>
+AsyncAnimatedGif::SetSharedFileWriter(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
+    gif->shared_file_writer = args[0]->BooleanValue();
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncAnimatedGif::SetMappedFile(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
+    gif->mapped_file = args[0]->BooleanValue();
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncAnimatedGif::SetDeltaTransparency(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - true or false.");
+
+    if (!args[0]->IsBoolean())
+        return VException("First argument must be boolean.");
+
+    AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
+    gif->delta_transparency = args[0]->BooleanValue();
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncAnimatedGif::SetFrameImages(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - maximum images per frame.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer maximum images per frame.");
+
+    int images = args[0]->Int32Value();
+    if (images < 1)
+        return VException("Maximum images per frame smaller than 1.");
+
+    AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
+    gif->frame_images = images;
+
+    return Undefined();
+}
+
+Handle<Value>
+AsyncAnimatedGif::SetFrameThreads(const Arguments &args)
+{
+    HandleScope scope;
+
+    int threads = 0;
+    if (args.Length() >= 1) {
+        if (!args[0]->IsInt32())
+            return VException("First argument must be integer number of threads.");
+        threads = args[0]->Int32Value();
+    }
+    if (threads < 0)
+        return VException("Number of threads smaller than 0.");
+
+    AsyncAnimatedGif *gif = ObjectWrap::Unwrap<AsyncAnimatedGif>(args.This());
+    gif->frame_threads = threads;
+
+    return Undefined();
+}
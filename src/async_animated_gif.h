@@ -2,6 +2,7 @@
 #define ASYNC_ANIMATED_GIF_H
 
 #include <string>
+#include <vector>
 
 #include <node.h>
 #include <node_buffer.h>
@@ -33,7 +34,11 @@ class AsyncAnimatedGif : public node::ObjectWrap {
     Color transparency_color;
 
     unsigned int push_id, fragment_id;
+    std::vector<int> delays; // of every frame ended so far, in 1/100s of a second
     std::string tmp_dir, output_file;
+    bool shared_file_writer, mapped_file, delta_transparency;
+    int frame_threads; // -1 for none
+    int frame_images;
 
     static void EIO_Push(uv_work_t *req);
     static void EIO_PushAfter(uv_work_t *req, int status);
@@ -41,7 +46,8 @@ class AsyncAnimatedGif : public node::ObjectWrap {
     static void EIO_Encode(uv_work_t *req);
     static void EIO_EncodeAfter(uv_work_t *req, int status);
 
-    static unsigned char *init_frame(int width, int height, Color &transparency_color);
+    static void init_frame(unsigned char *frame, int width, int height,
+        Color &transparency_color);
     static void push_fragment(unsigned char *frame, int width, int height, buffer_type buf_type,
         unsigned char *fragment, int x, int y, int w, int h);
     static Rect rect_dims(const char *fragment_name);
@@ -51,7 +57,7 @@ public:
 
     AsyncAnimatedGif(int wwidth, int hheight, buffer_type bbuf_type);
     v8::Handle<v8::Value> Push(unsigned char *data_buf, int x, int y, int w, int h);
-    void EndPush();
+    void EndPush(int delay=0);
 
     static v8::Handle<v8::Value> New(const v8::Arguments &args);
     static v8::Handle<v8::Value> Push(const v8::Arguments &args);
@@ -59,6 +65,11 @@ public:
     static v8::Handle<v8::Value> EndPush(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetOutputFile(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetTmpDir(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetSharedFileWriter(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetMappedFile(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetDeltaTransparency(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetFrameImages(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetFrameThreads(const v8::Arguments &args);
 };
 
 #endif
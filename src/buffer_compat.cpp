@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <node.h>
 #include <node_buffer.h>
 #include <node_version.h>
@@ -56,3 +57,18 @@ size_t BufferLength(v8::Local<v8::Object> buf_obj) {
 }
 
 #endif // NODE_VERSION
+
+
+static void
+FreeAdopted(char *data, void *hint) {
+  v8::V8::AdjustAmountOfExternalAllocatedMemory(-(intptr_t)hint);
+  free(data);
+}
+
+
+node::Buffer *BufferAdopt(char *data, size_t length) {
+  if (!data)
+    return node::Buffer::New(0);
+  v8::V8::AdjustAmountOfExternalAllocatedMemory((intptr_t)length);
+  return node::Buffer::New(data, length, FreeAdopted, (void *)length);
+}
@@ -11,5 +11,8 @@ size_t BufferLength(node::Buffer *b);
 char *BufferData(v8::Local<v8::Object> buf_obj);
 size_t BufferLength(v8::Local<v8::Object> buf_obj);
 
+// Makes a Buffer of malloc'd data without copying it; the Buffer frees it.
+node::Buffer *BufferAdopt(char *data, size_t length);
+
 
 #endif  // buffer_compat_h
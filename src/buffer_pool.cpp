@@ -0,0 +1,62 @@
+#include <cstdlib>
+
+#include <sys/mman.h>
+
+#include "buffer_pool.h"
+
+#define BUFFER_ALIGN 64
+#define HUGE_PAGE (2*1024*1024)
+
+BufferPool::BufferPool(size_t ssize, int mmax_spare) :
+    size(ssize), max_spare(mmax_spare)
+{
+    uv_mutex_init(&lock);
+}
+
+BufferPool::~BufferPool()
+{
+    for (size_t i = 0; i < spare.size(); i++)
+        free(spare[i]);
+    uv_mutex_destroy(&lock);
+}
+
+unsigned char *
+BufferPool::get()
+{
+    uv_mutex_lock(&lock);
+    unsigned char *buffer = NULL;
+    if (!spare.empty()) {
+        buffer = spare.back();
+        spare.pop_back();
+    }
+    uv_mutex_unlock(&lock);
+    return buffer ? buffer : alloc(size);
+}
+
+void
+BufferPool::put(unsigned char *buffer)
+{
+    if (!buffer)
+        return;
+    uv_mutex_lock(&lock);
+    if ((int)spare.size() < max_spare) {
+        spare.push_back(buffer);
+        buffer = NULL;
+    }
+    uv_mutex_unlock(&lock);
+    free(buffer);
+}
+
+unsigned char *
+BufferPool::alloc(size_t size)
+{
+    bool huge = size >= HUGE_PAGE;
+    void *buffer;
+    if (posix_memalign(&buffer, huge ? HUGE_PAGE : BUFFER_ALIGN, size) != 0)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (huge)
+        madvise(buffer, size, MADV_HUGEPAGE);
+#endif
+    return (unsigned char *)buffer;
+}
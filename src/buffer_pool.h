@@ -0,0 +1,30 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <cstddef>
+#include <vector>
+
+#include <uv.h>
+
+// Frame sized buffers that are handed out again once they're given back,
+// instead of a malloc and free per frame. get() and put() may be called
+// from different threads.
+class BufferPool {
+    size_t size;
+    int max_spare;
+    std::vector<unsigned char *> spare;
+    uv_mutex_t lock;
+
+public:
+    BufferPool(size_t ssize, int mmax_spare=8);
+    ~BufferPool();
+
+    unsigned char *get(); // NULL if out of memory
+    void put(unsigned char *buffer); // NULL is fine
+
+    // 64 byte aligned memory, backed by huge pages where it's big enough
+    // and the kernel has them. free() it.
+    static unsigned char *alloc(size_t size);
+};
+
+#endif
@@ -80,6 +80,7 @@ DynamicGifStack::Initialize(Handle<Object> target)
     NODE_SET_PROTOTYPE_METHOD(t, "push", Push);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", GifEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", GifEncodeSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeInto", GifEncodeInto);
     NODE_SET_PROTOTYPE_METHOD(t, "dimensions", Dimensions);
     target->Set(String::NewSymbol("DynamicGifStack"), t->GetFunction());
 }
@@ -107,7 +108,7 @@ DynamicGifStack::Push(unsigned char *buf_data, size_t buf_len, int x, int y, int
 }
 
 Handle<Value>
-DynamicGifStack::GifEncodeSync()
+DynamicGifStack::GifEncodeSync(FixedBuffer *into)
 {
     HandleScope scope;
 
@@ -133,14 +134,24 @@ DynamicGifStack::GifEncodeSync()
     try {
         GifEncoder encoder(data, width, height, BUF_RGB);
         encoder.set_transparency_color(transparency_color);
+        if (into)
+            encoder.set_output_func(fixed_buffer_writer, into);
         encoder.encode();
         free(data);
+        data = NULL;
+        if (into) {
+            if (into->overflow)
+                throw "Gif doesn't fit in the target buffer.";
+            return scope.Close(Integer::New(into->size));
+        }
         int gif_len = encoder.get_gif_len();
-        Buffer *retbuf = Buffer::New(gif_len);
-        memcpy(BufferData(retbuf), encoder.get_gif(), gif_len);
+        Buffer *retbuf = BufferAdopt((char *)encoder.release_gif(), gif_len);
         return scope.Close(retbuf->handle_);
     }
     catch (const char *err) {
+        free(data);
+        if (into && into->overflow)
+            return VException("Gif doesn't fit in the target buffer.");
         return VException(err);
     }
 }
@@ -250,6 +261,33 @@ DynamicGifStack::GifEncodeSync(const Arguments &args)
     return scope.Close(gif_stack->GifEncodeSync());
 }
 
+Handle<Value>
+DynamicGifStack::GifEncodeInto(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1)
+        return VException("At least one argument required - target buffer, [and offset]");
+    if (!Buffer::HasInstance(args[0]))
+        return VException("First argument must be Buffer.");
+
+    int offset = 0;
+    if (args.Length() > 1) {
+        if (!args[1]->IsInt32())
+            return VException("Second argument must be integer offset.");
+        offset = args[1]->Int32Value();
+    }
+
+    Local<Object> target = args[0]->ToObject();
+    int target_len = BufferLength(target);
+    if (offset < 0 || offset > target_len)
+        return VException("Offset outside of the target buffer.");
+
+    FixedBuffer into((unsigned char *)BufferData(target) + offset, target_len - offset);
+    DynamicGifStack *gif_stack = ObjectWrap::Unwrap<DynamicGifStack>(args.This());
+    return scope.Close(gif_stack->GifEncodeSync(&into));
+}
+
 void
 DynamicGifStack::EIO_GifEncode(uv_work_t *req)
 {
@@ -287,14 +325,7 @@ DynamicGifStack::EIO_GifEncode(uv_work_t *req)
         encoder.encode();
         free(data);
         enc_req->gif_len = encoder.get_gif_len();
-        enc_req->gif = (char *)malloc(sizeof(*enc_req->gif)*enc_req->gif_len);
-        if (!enc_req->gif) {
-            enc_req->error = strdup("malloc in DynamicGifStack::EIO_GifEncode failed.");
-            return;
-        }
-        else {
-            memcpy(enc_req->gif, encoder.get_gif(), enc_req->gif_len);
-        }
+        enc_req->gif = (char *)encoder.release_gif();
     }
     catch (const char *err) {
         enc_req->error = strdup(err);
@@ -321,8 +352,8 @@ DynamicGifStack::EIO_GifEncodeAfter(uv_work_t *req, int status)
         argv[2] = ErrorException(enc_req->error);
     }
     else {
-        Buffer *buf = Buffer::New(enc_req->gif_len);
-        memcpy(BufferData(buf), enc_req->gif, enc_req->gif_len);
+        Buffer *buf = BufferAdopt(enc_req->gif, enc_req->gif_len);
+        enc_req->gif = NULL;
         argv[0] = buf->handle_;
         argv[1] = gif->Dimensions();
         argv[2] = Undefined();
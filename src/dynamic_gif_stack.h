@@ -11,6 +11,8 @@
 
 #include "common.h"
 
+struct FixedBuffer;
+
 struct GifUpdate {
     int len, x, y, w, h;
     unsigned char *data;
@@ -50,13 +52,14 @@ public:
 
     v8::Handle<v8::Value> Push(unsigned char *buf_data, size_t buf_len, int x, int y, int w, int h);
     v8::Handle<v8::Value> Dimensions();
-    v8::Handle<v8::Value> GifEncodeSync();
+    v8::Handle<v8::Value> GifEncodeSync(FixedBuffer *into=NULL);
 
     static v8::Handle<v8::Value> New(const v8::Arguments &args);
     static v8::Handle<v8::Value> Push(const v8::Arguments &args);
     static v8::Handle<v8::Value> Dimensions(const v8::Arguments &args);
     static v8::Handle<v8::Value> GifEncodeSync(const v8::Arguments &args);
     static v8::Handle<v8::Value> GifEncodeAsync(const v8::Arguments &args);
+    static v8::Handle<v8::Value> GifEncodeInto(const v8::Arguments &args);
 };
 
 #endif
@@ -0,0 +1,401 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "file_writer.h"
+
+// most chunks written with one pwritev
+#define MAX_BATCH 64
+
+FileSubmitter::FileSubmitter() : stopping(false)
+{
+    uv_mutex_init(&lock);
+    uv_cond_init(&work);
+    uv_cond_init(&done);
+}
+
+FileSubmitter::~FileSubmitter()
+{
+    uv_cond_destroy(&done);
+    uv_cond_destroy(&work);
+    uv_mutex_destroy(&lock);
+}
+
+bool
+FileSubmitter::start()
+{
+    stopping = false;
+    return uv_thread_create(&thread, run, this) == 0;
+}
+
+void
+FileSubmitter::stop()
+{
+    uv_mutex_lock(&lock);
+    stopping = true;
+    uv_cond_signal(&work);
+    uv_mutex_unlock(&lock);
+    uv_thread_join(&thread);
+}
+
+static uv_once_t shared_once = UV_ONCE_INIT;
+static FileSubmitter *shared_submitter = NULL;
+
+static void
+start_shared_submitter()
+{
+    shared_submitter = new FileSubmitter;
+    if (!shared_submitter->start()) {
+        delete shared_submitter;
+        shared_submitter = NULL;
+    }
+}
+
+FileSubmitter *
+FileSubmitter::shared()
+{
+    uv_once(&shared_once, start_shared_submitter);
+    return shared_submitter;
+}
+
+void
+FileSubmitter::run(void *arg)
+{
+    FileSubmitter *submitter = (FileSubmitter *)arg;
+
+    uv_mutex_lock(&submitter->lock);
+    for (;;) {
+        while (submitter->ready.empty() && !submitter->stopping)
+            uv_cond_wait(&submitter->work, &submitter->lock);
+        if (submitter->ready.empty())
+            break;
+
+        FileWriter *writer = submitter->ready.front();
+        submitter->ready.pop_front();
+        submitter->write_out(writer);
+        if (writer->pending.empty())
+            writer->queued = false;
+        else
+            submitter->ready.push_back(writer);
+        uv_cond_broadcast(&submitter->done);
+    }
+    uv_mutex_unlock(&submitter->lock);
+}
+
+// Called with the lock held, which is let go during the write. The chunks
+// stay queued meanwhile, so that they count against max_pending.
+void
+FileSubmitter::write_out(FileWriter *writer)
+{
+    int n = std::min((int)writer->pending.size(), MAX_BATCH);
+    struct iovec iov[MAX_BATCH];
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = writer->pending[i].data;
+        iov[i].iov_len = writer->pending[i].size;
+    }
+    long long at = writer->pending[0].offset;
+    bool skip = !writer->error.empty();
+    uv_mutex_unlock(&lock);
+
+    // the chunks are back to back in the file, but pwritev may still
+    // write less than all of them
+    int first = 0, failed = 0;
+    while (!skip && first < n) {
+        ssize_t written = pwritev(writer->fd, &iov[first], n - first, at);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            failed = errno;
+            break;
+        }
+        at += written;
+        while (first < n && written >= (ssize_t)iov[first].iov_len) {
+            written -= iov[first].iov_len;
+            first++;
+        }
+        if (first < n) {
+            iov[first].iov_base = (char *)iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
+    }
+
+    uv_mutex_lock(&lock);
+    if (failed) {
+        errno = failed;
+        writer->set_error("pwritev");
+    }
+    for (int i = 0; i < n; i++) {
+        writer->spare.push_back(writer->pending.front().data);
+        writer->pending.pop_front();
+    }
+}
+
+FileWriter::FileWriter(int cchunk_size, int mmax_pending) :
+    fd(-1), chunk_size(cchunk_size), max_pending(mmax_pending), offset(0),
+    submitter(NULL), own_submitter(false), queued(false)
+{
+    current.data = NULL;
+    current.size = 0;
+    current.offset = 0;
+}
+
+FileWriter::~FileWriter()
+{
+    close();
+    for (size_t i = 0; i < spare.size(); i++)
+        free(spare[i]);
+}
+
+void
+FileWriter::set_error(const char *what)
+{
+    if (error.empty())
+        error = std::string(what) + " in FileWriter failed: " + strerror(errno);
+}
+
+bool
+FileWriter::open(const char *path, bool shared)
+{
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        set_error("open");
+        return false;
+    }
+    offset = 0;
+
+    if (shared) {
+        submitter = FileSubmitter::shared();
+    }
+    else {
+        submitter = new FileSubmitter;
+        own_submitter = true;
+        if (!submitter->start()) {
+            delete submitter;
+            submitter = NULL;
+            own_submitter = false;
+        }
+    }
+    if (!submitter) {
+        error = "starting a thread in FileWriter::open failed";
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool
+FileWriter::is_open() const
+{
+    return fd >= 0;
+}
+
+bool
+FileWriter::write(const unsigned char *data, int size)
+{
+    while (size > 0) {
+        if (!current.data) {
+            uv_mutex_lock(&submitter->lock);
+            if (!spare.empty()) {
+                current.data = spare.back();
+                spare.pop_back();
+            }
+            uv_mutex_unlock(&submitter->lock);
+            if (!current.data)
+                current.data = (unsigned char *)malloc(chunk_size);
+            if (!current.data) {
+                uv_mutex_lock(&submitter->lock);
+                if (error.empty())
+                    error = "malloc in FileWriter::write failed";
+                uv_mutex_unlock(&submitter->lock);
+                return false;
+            }
+            current.size = 0;
+            current.offset = offset;
+        }
+        int n = std::min(size, chunk_size - current.size);
+        memcpy(current.data + current.size, data, n);
+        current.size += n;
+        offset += n;
+        data += n;
+        size -= n;
+        if (current.size == chunk_size && !queue_current())
+            return false;
+    }
+    return true;
+}
+
+bool
+FileWriter::queue_current()
+{
+    uv_mutex_lock(&submitter->lock);
+    while ((int)pending.size() >= max_pending && error.empty())
+        uv_cond_wait(&submitter->done, &submitter->lock);
+    bool ok = error.empty();
+    if (ok) {
+        pending.push_back(current);
+        if (!queued) {
+            queued = true;
+            submitter->ready.push_back(this);
+            uv_cond_signal(&submitter->work);
+        }
+    }
+    else {
+        spare.push_back(current.data);
+    }
+    current.data = NULL;
+    uv_mutex_unlock(&submitter->lock);
+    return ok;
+}
+
+bool
+FileWriter::close()
+{
+    if (fd < 0)
+        return error.empty();
+
+    if (current.data) {
+        if (current.size > 0) {
+            queue_current();
+        }
+        else {
+            uv_mutex_lock(&submitter->lock);
+            spare.push_back(current.data);
+            uv_mutex_unlock(&submitter->lock);
+            current.data = NULL;
+        }
+    }
+
+    uv_mutex_lock(&submitter->lock);
+    while (queued)
+        uv_cond_wait(&submitter->done, &submitter->lock);
+    uv_mutex_unlock(&submitter->lock);
+
+    if (own_submitter) {
+        submitter->stop();
+        delete submitter;
+        own_submitter = false;
+    }
+    submitter = NULL;
+
+    if (error.empty() && fsync(fd) != 0)
+        set_error("fsync");
+    if (::close(fd) != 0)
+        set_error("close");
+    fd = -1;
+    return error.empty();
+}
+
+const char *
+FileWriter::get_error() const
+{
+    return error.c_str();
+}
+
+MappedFile::MappedFile(int eextent_size) :
+    fd(-1), extent_size(eextent_size), map(NULL), map_offset(0), size(0) {}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+void
+MappedFile::set_error(const char *what)
+{
+    if (error.empty())
+        error = std::string(what) + " in MappedFile failed: " + strerror(errno);
+}
+
+bool
+MappedFile::open(const char *path)
+{
+    fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        set_error("open");
+        return false;
+    }
+    map_offset = size = 0;
+    return true;
+}
+
+bool
+MappedFile::is_open() const
+{
+    return fd >= 0;
+}
+
+// moves the mapping on to the extent that starts at the current size
+bool
+MappedFile::map_extent()
+{
+    if (map) {
+        munmap(map, extent_size);
+        map = NULL;
+    }
+    map_offset = size;
+
+    int err = posix_fallocate(fd, map_offset, extent_size);
+    if (err) {
+        errno = err;
+        set_error("posix_fallocate");
+        return false;
+    }
+    void *m = mmap(NULL, extent_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, map_offset);
+    if (m == MAP_FAILED) {
+        set_error("mmap");
+        return false;
+    }
+    map = (unsigned char *)m;
+    madvise(map, extent_size, MADV_SEQUENTIAL);
+    return true;
+}
+
+bool
+MappedFile::write(const unsigned char *data, int len)
+{
+    if (!error.empty())
+        return false;
+    while (len > 0) {
+        if ((!map || size == map_offset + extent_size) && !map_extent())
+            return false;
+        int n = std::min((long long)len, map_offset + extent_size - size);
+        memcpy(map + (size - map_offset), data, n);
+        size += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool
+MappedFile::close()
+{
+    if (fd < 0)
+        return error.empty();
+
+    if (map) {
+        munmap(map, extent_size);
+        map = NULL;
+    }
+    if (ftruncate(fd, size) != 0)
+        set_error("ftruncate");
+    if (error.empty() && fsync(fd) != 0)
+        set_error("fsync");
+    if (::close(fd) != 0)
+        set_error("close");
+    fd = -1;
+    return error.empty();
+}
+
+const char *
+MappedFile::get_error() const
+{
+    return error.c_str();
+}
@@ -0,0 +1,106 @@
+#ifndef FILE_WRITER_H
+#define FILE_WRITER_H
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <uv.h>
+
+class FileWriter;
+
+// A thread that writes out the queued chunks of one or more FileWriters,
+// all chunks a writer has waiting with a single pwritev().
+class FileSubmitter {
+    uv_thread_t thread;
+    uv_mutex_t lock;
+    uv_cond_t work, done;
+    std::deque<FileWriter *> ready;
+    bool stopping;
+
+    static void run(void *arg);
+    void write_out(FileWriter *writer);
+
+    friend class FileWriter;
+public:
+    FileSubmitter();
+    ~FileSubmitter();
+
+    bool start();
+    void stop();
+
+    // the one thread all shared FileWriters use
+    static FileSubmitter *shared();
+};
+
+// Write-behind file output. Writes are collected into chunk_size buffers
+// that a background thread writes at chunk aligned offsets, so the thread
+// that encodes never waits for the disk - unless more than max_pending
+// chunks are still waiting to be written. The buffers get reused.
+class FileWriter {
+    struct Chunk {
+        unsigned char *data;
+        int size;
+        long long offset;
+    };
+
+    int fd;
+    int chunk_size, max_pending;
+    Chunk current;
+    long long offset;
+
+    FileSubmitter *submitter;
+    bool own_submitter;
+
+    // all of these are guarded by submitter->lock
+    std::deque<Chunk> pending;
+    std::vector<unsigned char *> spare;
+    bool queued;
+    std::string error;
+
+    bool queue_current();
+    void set_error(const char *what);
+
+    friend class FileSubmitter;
+public:
+    FileWriter(int cchunk_size=1024*1024, int mmax_pending=8);
+    ~FileWriter();
+
+    // with shared=true the file is written by FileSubmitter::shared(),
+    // otherwise by a thread of its own
+    bool open(const char *path, bool shared=false);
+    bool is_open() const;
+    bool write(const unsigned char *data, int size); // false after an error
+    // writes out what's left, waits for all of it to reach the disk and
+    // closes the file. May be called from any thread; false on error.
+    bool close();
+    const char *get_error() const;
+};
+
+// Output straight into a shared mapping of the file. The file is grown
+// extent_size at a time with posix_fallocate(), so that running out of
+// disk shows up as an error from write() instead of a SIGBUS, and only the
+// extent being written is mapped. The kernel writes the pages back on its
+// own; close() cuts the file to the size actually written.
+class MappedFile {
+    int fd;
+    int extent_size;
+    unsigned char *map;
+    long long map_offset, size;
+    std::string error;
+
+    bool map_extent();
+    void set_error(const char *what);
+public:
+    MappedFile(int eextent_size=32*1024*1024);
+    ~MappedFile();
+
+    bool open(const char *path);
+    bool is_open() const;
+    bool write(const unsigned char *data, int size); // false after an error
+    // unmaps, truncates, syncs and closes the file. false on error.
+    bool close();
+    const char *get_error() const;
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <utility>
 #include "common.h"
 #include "gif_encoder.h"
 #include "gif.h"
@@ -17,15 +19,24 @@ Gif::Initialize(Handle<Object> target)
     t->InstanceTemplate()->SetInternalFieldCount(1);
     NODE_SET_PROTOTYPE_METHOD(t, "encode", GifEncodeAsync);
     NODE_SET_PROTOTYPE_METHOD(t, "encodeSync", GifEncodeSync);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeInto", GifEncodeInto);
+    NODE_SET_PROTOTYPE_METHOD(t, "encodeStream", GifEncodeStream);
     NODE_SET_PROTOTYPE_METHOD(t, "setTransparencyColor", SetTransparencyColor);
-    target->Set(String::NewSymbol("Gif"), t->GetFunction());
+    NODE_SET_PROTOTYPE_METHOD(t, "setTiles", SetTiles);
+    NODE_SET_PROTOTYPE_METHOD(t, "setLossy", SetLossy);
+    NODE_SET_PROTOTYPE_METHOD(t, "setClearThreshold", SetClearThreshold);
+    Local<Function> gif = t->GetFunction();
+    gif->Set(String::NewSymbol("maxEncodedSize"), FunctionTemplate::New(MaxEncodedSize)->GetFunction());
+    target->Set(String::NewSymbol("Gif"), gif);
 }
 
 Gif::Gif(int wwidth, int hheight, buffer_type bbuf_type) :
-  width(wwidth), height(hheight), buf_type(bbuf_type) {}
+  width(wwidth), height(hheight), buf_type(bbuf_type),
+  tile_width(0), tile_height(0), tile_threads(0), lossy_error(0),
+  clear_threshold(0) {}
 
 Handle<Value>
-Gif::GifEncodeSync()
+Gif::GifEncodeSync(FixedBuffer *into)
 {
     HandleScope scope;
 
@@ -38,13 +49,24 @@ Gif::GifEncodeSync()
         if (transparency_color.color_present) {
             encoder.set_transparency_color(transparency_color);
         }
+        encoder.set_tiles(tile_width, tile_height, tile_threads);
+        encoder.set_lossy(lossy_error);
+        encoder.set_clear_threshold(clear_threshold);
+        if (into)
+            encoder.set_output_func(fixed_buffer_writer, into);
         encoder.encode();
+        if (into) {
+            if (into->overflow)
+                throw "Gif doesn't fit in the target buffer.";
+            return scope.Close(Integer::New(into->size));
+        }
         int gif_len = encoder.get_gif_len();
-        Buffer *retbuf = Buffer::New(gif_len);
-        memcpy(BufferData(retbuf), encoder.get_gif(), gif_len);
+        Buffer *retbuf = BufferAdopt((char *)encoder.release_gif(), gif_len);
         return scope.Close(retbuf->handle_);
     }
     catch (const char *err) {
+        if (into && into->overflow)
+            return VException("Gif doesn't fit in the target buffer.");
         return VException(err);
     }
 }
@@ -55,6 +77,26 @@ Gif::SetTransparencyColor(unsigned char r, unsigned char g, unsigned char b)
     transparency_color = Color(r, g, b, true);
 }
 
+void
+Gif::SetTiles(int ttile_width, int ttile_height, int tthreads)
+{
+    tile_width = ttile_width;
+    tile_height = ttile_height;
+    tile_threads = tthreads;
+}
+
+void
+Gif::SetLossy(int error)
+{
+    lossy_error = error;
+}
+
+void
+Gif::SetClearThreshold(int threshold)
+{
+    clear_threshold = threshold;
+}
+
 Handle<Value>
 Gif::New(const Arguments &args)
 {
@@ -120,6 +162,65 @@ Gif::GifEncodeSync(const Arguments &args)
     return scope.Close(gif->GifEncodeSync());
 }
 
+Handle<Value>
+Gif::GifEncodeInto(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 1)
+        return VException("At least one argument required - target buffer, [and offset]");
+    if (!Buffer::HasInstance(args[0]))
+        return VException("First argument must be Buffer.");
+
+    int offset = 0;
+    if (args.Length() > 1) {
+        if (!args[1]->IsInt32())
+            return VException("Second argument must be integer offset.");
+        offset = args[1]->Int32Value();
+    }
+
+    Local<Object> target = args[0]->ToObject();
+    int target_len = BufferLength(target);
+    if (offset < 0 || offset > target_len)
+        return VException("Offset outside of the target buffer.");
+
+    FixedBuffer into((unsigned char *)BufferData(target) + offset, target_len - offset);
+    Gif *gif = ObjectWrap::Unwrap<Gif>(args.This());
+    return scope.Close(gif->GifEncodeSync(&into));
+}
+
+Handle<Value>
+Gif::MaxEncodedSize(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 2)
+        return VException("At least two arguments required - width, height, [and number of colors]");
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer width.");
+    if (!args[1]->IsInt32())
+        return VException("Second argument must be integer height.");
+
+    int colors = 256;
+    if (args.Length() > 2) {
+        if (!args[2]->IsInt32())
+            return VException("Third argument must be integer number of colors.");
+        colors = args[2]->Int32Value();
+    }
+
+    int w = args[0]->Int32Value();
+    int h = args[1]->Int32Value();
+
+    if (w < 0)
+        return VException("Width smaller than 0.");
+    if (h < 0)
+        return VException("Height smaller than 0.");
+    if (colors < 2 || colors > 256)
+        return VException("Number of colors must be between 2 and 256.");
+
+    return scope.Close(Integer::New(GifEncoder::max_gif_size(w, h, colors)));
+}
+
 Handle<Value>
 Gif::SetTransparencyColor(const Arguments &args)
 {
@@ -145,6 +246,84 @@ Gif::SetTransparencyColor(const Arguments &args)
     return Undefined();
 }
 
+Handle<Value>
+Gif::SetTiles(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 2)
+        return VException("At least two arguments required - tile width, tile height, [and number of threads]");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer tile width.");
+    if (!args[1]->IsInt32())
+        return VException("Second argument must be integer tile height.");
+
+    int threads = 0;
+    if (args.Length() > 2) {
+        if (!args[2]->IsInt32())
+            return VException("Third argument must be integer number of threads.");
+        threads = args[2]->Int32Value();
+    }
+
+    int tile_width = args[0]->Int32Value();
+    int tile_height = args[1]->Int32Value();
+
+    if (tile_width < 0)
+        return VException("Tile width smaller than 0.");
+    if (tile_height < 0)
+        return VException("Tile height smaller than 0.");
+    if (threads < 0)
+        return VException("Number of threads smaller than 0.");
+
+    Gif *gif = ObjectWrap::Unwrap<Gif>(args.This());
+    gif->SetTiles(tile_width, tile_height, threads);
+
+    return Undefined();
+}
+
+Handle<Value>
+Gif::SetLossy(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - maximum color error.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer maximum color error.");
+
+    int error = args[0]->Int32Value();
+    if (error < 0)
+        return VException("Maximum color error smaller than 0.");
+
+    Gif *gif = ObjectWrap::Unwrap<Gif>(args.This());
+    gif->SetLossy(error);
+
+    return Undefined();
+}
+
+Handle<Value>
+Gif::SetClearThreshold(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() != 1)
+        return VException("One argument required - threshold in percent.");
+
+    if (!args[0]->IsInt32())
+        return VException("First argument must be integer threshold in percent.");
+
+    int threshold = args[0]->Int32Value();
+    if (threshold < 0)
+        return VException("Threshold smaller than 0.");
+
+    Gif *gif = ObjectWrap::Unwrap<Gif>(args.This());
+    gif->SetClearThreshold(threshold);
+
+    return Undefined();
+}
+
 void
 Gif::EIO_GifEncode(uv_work_t *req)
 {
@@ -156,16 +335,12 @@ Gif::EIO_GifEncode(uv_work_t *req)
         if (gif->transparency_color.color_present) {
             encoder.set_transparency_color(gif->transparency_color);
         }
+        encoder.set_tiles(gif->tile_width, gif->tile_height, gif->tile_threads);
+        encoder.set_lossy(gif->lossy_error);
+        encoder.set_clear_threshold(gif->clear_threshold);
         encoder.encode();
         enc_req->gif_len = encoder.get_gif_len();
-        enc_req->gif = (char *)malloc(sizeof(*enc_req->gif)*enc_req->gif_len);
-        if (!enc_req->gif) {
-            enc_req->error = strdup("malloc in Gif::EIO_GifEncode failed.");
-            return;
-        }
-        else {
-            memcpy(enc_req->gif, encoder.get_gif(), enc_req->gif_len);
-        }
+        enc_req->gif = (char *)encoder.release_gif();
     }
     catch (const char *err) {
         enc_req->error = strdup(err);
@@ -189,8 +364,8 @@ Gif::EIO_GifEncodeAfter(uv_work_t *req, int status)
         argv[1] = ErrorException(enc_req->error);
     }
     else {
-        Buffer *buf = Buffer::New(enc_req->gif_len);
-        memcpy(BufferData(buf), enc_req->gif, enc_req->gif_len);
+        Buffer *buf = BufferAdopt(enc_req->gif, enc_req->gif_len);
+        enc_req->gif = NULL;
         argv[0] = buf->handle_;
         argv[1] = Undefined();
     }
@@ -257,3 +432,166 @@ Gif::GifEncodeAsync(const Arguments &args)
     return Undefined();
 }
 
+// Output of encodeStream. The thread pool queues chunks as the encoder
+// produces them and wakes up the loop thread with async to hand them to JS.
+struct stream_request {
+    Persistent<Function> chunk_callback, callback;
+    Gif *gif_obj;
+    char *buf_data;
+    char *error;
+    GifSink sink;
+    uv_async_t async;
+    uv_mutex_t lock;
+    std::deque<std::pair<char *, int> > chunks; // guarded by lock
+};
+
+static int
+stream_chunk_writer(GifFileType *gif_file, const GifByteType *data, int size)
+{
+    stream_request *stream_req = (stream_request *)gif_file->UserData;
+
+    char *chunk = (char *)malloc(size);
+    if (!chunk)
+        return 0;
+    memcpy(chunk, data, size);
+
+    uv_mutex_lock(&stream_req->lock);
+    stream_req->chunks.push_back(std::make_pair(chunk, size));
+    uv_mutex_unlock(&stream_req->lock);
+    uv_async_send(&stream_req->async);
+    return size;
+}
+
+static void
+stream_request_free(uv_handle_t *handle)
+{
+    stream_request *stream_req = (stream_request *)handle->data;
+    uv_mutex_destroy(&stream_req->lock);
+    delete stream_req;
+}
+
+void
+Gif::EIO_GifEncodeStream(uv_work_t *req)
+{
+    stream_request *stream_req = (stream_request *)req->data;
+    Gif *gif = stream_req->gif_obj;
+
+    try {
+        GifEncoder encoder((unsigned char *)stream_req->buf_data, gif->width, gif->height, gif->buf_type);
+        if (gif->transparency_color.color_present) {
+            encoder.set_transparency_color(gif->transparency_color);
+        }
+        encoder.set_tiles(gif->tile_width, gif->tile_height, gif->tile_threads);
+        encoder.set_lossy(gif->lossy_error);
+        encoder.set_clear_threshold(gif->clear_threshold);
+        encoder.set_output_func(sink_writer, &stream_req->sink);
+        encoder.encode();
+        if (!stream_req->sink.flush())
+            throw "malloc in Gif::EIO_GifEncodeStream failed";
+    }
+    catch (const char *err) {
+        stream_req->error = strdup(err);
+    }
+}
+
+void
+Gif::DeliverChunks(stream_request *stream_req)
+{
+    HandleScope scope;
+
+    std::deque<std::pair<char *, int> > chunks;
+    uv_mutex_lock(&stream_req->lock);
+    chunks.swap(stream_req->chunks);
+    uv_mutex_unlock(&stream_req->lock);
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        Buffer *buf = BufferAdopt(chunks[i].first, chunks[i].second);
+        Handle<Value> argv[1] = { buf->handle_ };
+
+        TryCatch try_catch;
+        stream_req->chunk_callback->Call(Context::GetCurrent()->Global(), 1, argv);
+        if (try_catch.HasCaught())
+            FatalException(try_catch);
+    }
+}
+
+void
+Gif::GifEncodeStreamChunks(uv_async_t *handle, int status)
+{
+    DeliverChunks((stream_request *)handle->data);
+}
+
+void
+Gif::EIO_GifEncodeStreamAfter(uv_work_t *req, int status)
+{
+    HandleScope scope;
+
+    stream_request *stream_req = (stream_request *)req->data;
+    delete req;
+
+    // sends coalesce, the last chunks may not have been delivered yet
+    DeliverChunks(stream_req);
+
+    Handle<Value> argv[1];
+    if (stream_req->error)
+        argv[0] = ErrorException(stream_req->error);
+    else
+        argv[0] = Undefined();
+
+    TryCatch try_catch;
+    stream_req->callback->Call(Context::GetCurrent()->Global(), 1, argv);
+    if (try_catch.HasCaught())
+        FatalException(try_catch);
+
+    stream_req->chunk_callback.Dispose();
+    stream_req->callback.Dispose();
+    free(stream_req->error);
+    stream_req->gif_obj->Unref();
+    uv_close((uv_handle_t *)&stream_req->async, stream_request_free);
+}
+
+Handle<Value>
+Gif::GifEncodeStream(const Arguments &args)
+{
+    HandleScope scope;
+
+    if (args.Length() < 2)
+        return VException("At least two arguments required - chunk callback, end callback, [and high water mark].");
+
+    if (!args[0]->IsFunction())
+        return VException("First argument must be a function.");
+    if (!args[1]->IsFunction())
+        return VException("Second argument must be a function.");
+    if (args.Length() > 2 && !args[2]->IsInt32())
+        return VException("Third argument must be integer high water mark.");
+
+    int high_water = args.Length() > 2 ? args[2]->Int32Value() : 64*1024;
+    if (high_water < 0)
+        return VException("High water mark smaller than 0.");
+
+    Gif *gif = ObjectWrap::Unwrap<Gif>(args.This());
+
+    stream_request *stream_req = new stream_request;
+    stream_req->chunk_callback = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+    stream_req->callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+    stream_req->gif_obj = gif;
+    stream_req->error = NULL;
+    stream_req->sink.func = stream_chunk_writer;
+    stream_req->sink.user_data = stream_req;
+    stream_req->sink.high_water = high_water;
+    uv_mutex_init(&stream_req->lock);
+    uv_async_init(uv_default_loop(), &stream_req->async, GifEncodeStreamChunks);
+    stream_req->async.data = stream_req;
+
+    Local<Value> buf_val = gif->handle_->GetHiddenValue(String::New("buffer"));
+    stream_req->buf_data = BufferData(buf_val->ToObject());
+
+    uv_work_t *req = new uv_work_t;
+    req->data = stream_req;
+    uv_queue_work(uv_default_loop(), req, EIO_GifEncodeStream, EIO_GifEncodeStreamAfter);
+
+    gif->Ref();
+
+    return Undefined();
+}
+
@@ -6,24 +6,42 @@
 
 #include "common.h"
 
+struct FixedBuffer;
+struct stream_request;
+
 class Gif : public node::ObjectWrap {
     int width, height;
     buffer_type buf_type;
     Color transparency_color;
+    int tile_width, tile_height, tile_threads;
+    int lossy_error, clear_threshold;
 
     static void EIO_GifEncode(uv_work_t *req);
     static void EIO_GifEncodeAfter(uv_work_t *req, int status);
+    static void EIO_GifEncodeStream(uv_work_t *req);
+    static void EIO_GifEncodeStreamAfter(uv_work_t *req, int status);
+    static void GifEncodeStreamChunks(uv_async_t *handle, int status);
+    static void DeliverChunks(stream_request *stream_req);
 
 public:
     static void Initialize(v8::Handle<v8::Object> target);
     Gif(int wwidth, int hheight, buffer_type bbuf_type);
-    v8::Handle<v8::Value> GifEncodeSync();
+    v8::Handle<v8::Value> GifEncodeSync(FixedBuffer *into=NULL);
     void SetTransparencyColor(unsigned char r, unsigned char g, unsigned char b);
+    void SetTiles(int ttile_width, int ttile_height, int tthreads);
+    void SetLossy(int error);
+    void SetClearThreshold(int threshold);
 
     static v8::Handle<v8::Value> New(const v8::Arguments &args);
     static v8::Handle<v8::Value> GifEncodeSync(const v8::Arguments &args);
     static v8::Handle<v8::Value> GifEncodeAsync(const v8::Arguments &args);
+    static v8::Handle<v8::Value> GifEncodeInto(const v8::Arguments &args);
+    static v8::Handle<v8::Value> GifEncodeStream(const v8::Arguments &args);
+    static v8::Handle<v8::Value> MaxEncodedSize(const v8::Arguments &args);
     static v8::Handle<v8::Value> SetTransparencyColor(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetTiles(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetLossy(const v8::Arguments &args);
+    static v8::Handle<v8::Value> SetClearThreshold(const v8::Arguments &args);
 };
 
 #endif
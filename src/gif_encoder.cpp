@@ -1,10 +1,22 @@
+#include <climits>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <unistd.h>
+#include <uv.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "loki/ScopeGuard.h"
 
+#include "buffer_pool.h"
 #include "gif_encoder.h"
 #include "palette.h"
 #include "quantize.h"
@@ -33,11 +45,186 @@ nearest_pow2(int n)
     return (int)pow(2, ceil(log2(n)));
 }
 
-GifImage::GifImage() : size(0), mem_size(0), gif(NULL) {}
-GifImage::~GifImage() { free(gif); }
+static int
+bytes_per_pixel(buffer_type buf_type)
+{
+    return (buf_type == BUF_RGBA || buf_type == BUF_BGRA) ? 4 : 3;
+}
+
+// Copies the w*h rectangle at (x, y) out of a width pixels wide buffer
+// into its own contiguous buffer, keeping the pixel format.
+static unsigned char *
+copy_rect(unsigned char *data, int width, buffer_type buf_type, int x, int y, int w, int h)
+{
+    int bpp = bytes_per_pixel(buf_type);
+    unsigned char *rect = (unsigned char *)malloc(sizeof(*rect)*w*h*bpp);
+    if (!rect) return NULL;
+
+    unsigned char *rectp = rect;
+    for (int i = 0; i < h; i++) {
+        memcpy(rectp, &data[((y + i)*width + x)*bpp], w*bpp);
+        rectp += w*bpp;
+    }
+    return rect;
+}
+
+// Compresses w*h quantized pixels into a standalone block - optional
+// graphics control extension, image descriptor at (left, top) and LZW
+// data - which can be spliced into any gif that uses the same color map.
+static void
+put_image_block(GifImage &block, ColorMapObject *color_map, int color_map_size,
+    char *extension, int transparent_index, const CompressOptions &options,
+    int left, int top, int w, int h, GifByteType *pixels)
+{
+    int nError;
+    block.reserve(w*h/4 + 256);
+    GifFileType *gif_file = EGifOpen(&block, gif_writer, &nError);
+    if (!gif_file)
+        throw "EGifOpen in put_image_block failed";
+    options.apply(gif_file);
+
+    // giflib insists on a screen descriptor before the image, so write it
+    // and then throw it away.
+    int start = block.size;
+    if (EGifPutScreenDesc(gif_file, w, h, color_map_size, 0, color_map) == GIF_ERROR) {
+        EGifCloseFile(gif_file);
+        throw "EGifPutScreenDesc in put_image_block failed";
+    }
+    block.truncate(start);
+
+    if (extension)
+        EGifPutExtension(gif_file, GRAPHICS_EXT_FUNC_CODE, 4, extension);
+    // lossy matching has to leave the transparent color alone also when
+    // the extension is written later, by whoever puts the block in place
+    EGifSetTransparentIndex(gif_file, transparent_index);
+
+    if (EGifPutImageDesc(gif_file, left, top, w, h, FALSE, NULL) == GIF_ERROR) {
+        EGifCloseFile(gif_file);
+        throw "EGifPutImageDesc in put_image_block failed";
+    }
+
+    GifByteType *pixelsp = pixels;
+    for (int i = 0; i < h; i++) {
+        if (EGifPutLine(gif_file, pixelsp, w) == GIF_ERROR) {
+            EGifCloseFile(gif_file);
+            throw "EGifPutLine in put_image_block failed";
+        }
+        pixelsp += w;
+    }
+
+    // and the same for the trailer EGifCloseFile writes.
+    int end = block.size;
+    EGifCloseFile(gif_file);
+    block.truncate(end);
+}
+
+void
+CompressOptions::apply(GifFileType *gif_file) const
+{
+    EGifSetLossyError(gif_file, lossy_error);
+    EGifSetClearThreshold(gif_file, clear_threshold);
+}
+
+GifImage::GifImage() : size(0), first_chunk_size(16*1024) {}
+
+GifImage::~GifImage()
+{
+    for (size_t i = 0; i < chunks.size(); i++)
+        free(chunks[i].data);
+}
+
+void
+GifImage::reserve(int estimate)
+{
+    if (chunks.empty() && estimate > first_chunk_size)
+        first_chunk_size = estimate;
+}
+
+void
+GifImage::append(const unsigned char *data, int len)
+{
+    while (len > 0) {
+        if (chunks.empty() || chunks.back().used == chunks.back().size) {
+            // every new chunk is as big as all the previous ones together
+            Chunk chunk;
+            chunk.size = chunks.empty() ? first_chunk_size : size;
+            if (chunk.size < len)
+                chunk.size = len;
+            chunk.used = 0;
+            chunk.data = (unsigned char *)malloc(chunk.size);
+            if (!chunk.data)
+                throw "malloc in GifImage::append failed";
+            chunks.push_back(chunk);
+        }
+        Chunk &last = chunks.back();
+        int n = std::min(len, last.size - last.used);
+        memcpy(last.data + last.used, data, n);
+        last.used += n;
+        size += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void
+GifImage::truncate(int new_size)
+{
+    if (new_size >= size)
+        return;
+    int offset = 0;
+    size_t keep = 0;
+    for (; keep < chunks.size(); keep++) {
+        if (keep > 0 && offset >= new_size)
+            break;
+        if (chunks[keep].used > new_size - offset)
+            chunks[keep].used = new_size - offset;
+        offset += chunks[keep].used;
+    }
+    for (size_t i = keep; i < chunks.size(); i++)
+        free(chunks[i].data);
+    chunks.resize(keep);
+    size = new_size;
+}
+
+void
+GifImage::flatten()
+{
+    if (chunks.size() < 2)
+        return;
+    Chunk flat;
+    flat.size = flat.used = size;
+    flat.data = (unsigned char *)malloc(size);
+    if (!flat.data)
+        throw "malloc in GifImage::flatten failed";
+    int offset = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        memcpy(flat.data + offset, chunks[i].data, chunks[i].used);
+        offset += chunks[i].used;
+        free(chunks[i].data);
+    }
+    chunks.assign(1, flat);
+}
+
+const unsigned char *
+GifImage::data() const
+{
+    return chunks.empty() ? NULL : chunks[0].data;
+}
+
+unsigned char *
+GifImage::release()
+{
+    flatten();
+    unsigned char *ret = chunks.empty() ? NULL : chunks[0].data;
+    chunks.clear();
+    size = 0;
+    return ret;
+}
 
 GifEncoder::GifEncoder(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type) :
-    data(ddata), width(wwidth), height(hheight), buf_type(bbuf_type) {}
+    data(ddata), width(wwidth), height(hheight), buf_type(bbuf_type),
+    tile_width(0), tile_height(0), tile_threads(0),
+    output_func(gif_writer), output_data(&gif) {}
 
 RGBator::RGBator(unsigned char *data, int width, int height, buffer_type buf_type) {
     memory = (GifByteType *)malloc(sizeof(GifFileType)*width*height*3);
@@ -129,20 +316,79 @@ int
 gif_writer(GifFileType *gif_file, const GifByteType *data, int size)
 {
     GifImage *gif = (GifImage *)gif_file->UserData;
-    if (gif->size + size > gif->mem_size) {
-        GifByteType *new_ptr = (GifByteType *)realloc(gif->gif, gif->size + size + 10*1024);
-        if (!new_ptr)
-            throw "realloc in gif_writer failed";
-        gif->gif = new_ptr;
-        gif->mem_size = gif->size + size + 10*1024;
-    }
-    memcpy(gif->gif + gif->size, data, size);
-    gif->size += size;
+    gif->append(data, size);
+    return size;
+}
+
+bool
+GifSink::write(const unsigned char *data, int size)
+{
+    if (pending.empty() && size >= high_water)
+        return pass_on(data, size);
+    pending.insert(pending.end(), data, data + size);
+    if ((int)pending.size() >= high_water)
+        return flush();
+    return true;
+}
+
+bool
+GifSink::flush()
+{
+    if (pending.empty())
+        return true;
+    bool ok = pass_on(&pending[0], pending.size());
+    pending.clear();
+    return ok;
+}
+
+bool
+GifSink::pass_on(const unsigned char *data, int size)
+{
+    // func only looks at UserData, and the gif file that wrote the data
+    // may be closed already when the trailer gets flushed.
+    GifFileType gif_file;
+    memset(&gif_file, 0, sizeof(gif_file));
+    gif_file.UserData = user_data;
+    return func(&gif_file, data, size) == size;
+}
+
+int
+sink_writer(GifFileType *gif_file, const GifByteType *data, int size)
+{
+    GifSink *sink = (GifSink *)gif_file->UserData;
+    return sink->write(data, size) ? size : 0;
+}
+
+int
+fixed_buffer_writer(GifFileType *gif_file, const GifByteType *data, int size)
+{
+    FixedBuffer *into = (FixedBuffer *)gif_file->UserData;
+    if (into->size + size > into->capacity) {
+        into->overflow = true;
+        return 0;
+    }
+    memcpy(into->data + into->size, data, size);
+    into->size += size;
     return size;
 }
 
 void
 GifEncoder::encode()
+{
+    // LZW output of web safe images rarely exceeds a byte per four pixels
+    if (output_func == gif_writer)
+        gif.reserve(width*height/4 + 1024);
+
+    if (tile_width > 0 && tile_height > 0 && (tile_width < width || tile_height < height))
+        encode_tiled();
+    else
+        encode_whole();
+
+    gif.flatten();
+}
+
+void
+GifEncoder::encode_whole()
 {
     RGBator rgb(data, width, height, buf_type);
 
@@ -170,10 +416,11 @@ GifEncoder::encode()
     */
 
     int nError;
-    GifFileType *gif_file = EGifOpen(&gif, gif_writer, &nError);
+    GifFileType *gif_file = EGifOpen(output_data, output_func, &nError);
     LOKI_ON_BLOCK_EXIT(EGifCloseFile, gif_file);
     if (!gif_file)
         throw "EGifOpen in GifEncoder::encode failed";
+    compress_options.apply(gif_file);
 
     if (EGifPutScreenDesc(gif_file, width, height,
         color_map_size, 0, output_color_map) == GIF_ERROR)
@@ -205,6 +452,215 @@ GifEncoder::encode()
     }
 }
 
+struct tile_job {
+    Rect rect;
+    GifImage block;
+};
+
+struct tile_pool {
+    unsigned char *data;
+    int width;
+    buffer_type buf_type;
+
+    ColorMapObject *color_map;
+    int color_map_size;
+    char *extension;
+    int transparent_index;
+    CompressOptions compress_options;
+
+    tile_job *jobs;
+    int njobs, next_job;
+    uv_mutex_t lock;
+    const char *error;
+};
+
+static void
+free_tile_jobs(tile_job *jobs)
+{
+    delete [] jobs;
+}
+
+void
+GifEncoder::tile_worker(void *arg)
+{
+    tile_pool *pool = (tile_pool *)arg;
+
+    for (;;) {
+        uv_mutex_lock(&pool->lock);
+        int n = pool->error ? pool->njobs : pool->next_job++;
+        uv_mutex_unlock(&pool->lock);
+        if (n >= pool->njobs)
+            return;
+
+        tile_job &job = pool->jobs[n];
+        Rect &r = job.rect;
+        try {
+            unsigned char *tile = copy_rect(pool->data, pool->width, pool->buf_type,
+                r.x, r.y, r.w, r.h);
+            LOKI_ON_BLOCK_EXIT(free, tile);
+            if (!tile)
+                throw "malloc in GifEncoder::tile_worker failed";
+
+            RGBator rgb(tile, r.w, r.h, pool->buf_type);
+
+            GifByteType *tile_buf = (GifByteType *)malloc(sizeof(GifByteType)*r.w*r.h);
+            LOKI_ON_BLOCK_EXIT(free, tile_buf);
+            if (!tile_buf)
+                throw "malloc in GifEncoder::tile_worker failed";
+
+            if (web_safe_quantize(r.w, r.h, rgb.red, rgb.green, rgb.blue, tile_buf) == GIF_ERROR)
+                throw "web_safe_quantize in GifEncoder::tile_worker failed";
+
+            put_image_block(job.block, pool->color_map, pool->color_map_size,
+                pool->extension, pool->transparent_index, pool->compress_options,
+                r.x, r.y, r.w, r.h, tile_buf);
+        }
+        catch (const char *err) {
+            uv_mutex_lock(&pool->lock);
+            pool->error = err;
+            uv_mutex_unlock(&pool->lock);
+        }
+    }
+}
+
+void
+GifEncoder::encode_tiled()
+{
+    int color_map_size = 256;
+    ColorMapObject *output_color_map = GifMakeMapObject(256, ext_web_safe_palette);
+    LOKI_ON_BLOCK_EXIT(GifFreeMapObject, output_color_map);
+    if (!output_color_map)
+        throw "MakeMapObject in GifEncoder::encode_tiled failed";
+
+    int nError;
+    GifFileType *gif_file = EGifOpen(output_data, output_func, &nError);
+    LOKI_ON_BLOCK_EXIT(EGifCloseFile, gif_file);
+    if (!gif_file)
+        throw "EGifOpen in GifEncoder::encode_tiled failed";
+    compress_options.apply(gif_file);
+
+    if (EGifPutScreenDesc(gif_file, width, height,
+        color_map_size, 0, output_color_map) == GIF_ERROR)
+    {
+        throw "EGifPutScreenDesc in GifEncoder::encode_tiled failed";
+    }
+
+    // every tile is its own image, so each needs its own transparency extension
+    char extension[4];
+    bool has_extension = false;
+    if (transparency_color.color_present) {
+        int i = find_color_index(output_color_map, color_map_size, transparency_color);
+        if (i >= 0) {
+            extension[0] = 1; // enable transparency
+            extension[1] = extension[2] = 0; // no time delay
+            extension[3] = i; // transparency color index
+            has_extension = true;
+        }
+    }
+
+    int tiles_x = (width + tile_width - 1)/tile_width;
+    int tiles_y = (height + tile_height - 1)/tile_height;
+
+    tile_pool pool;
+    pool.data = data;
+    pool.width = width;
+    pool.buf_type = buf_type;
+    pool.color_map = output_color_map;
+    pool.color_map_size = color_map_size;
+    pool.extension = has_extension ? extension : NULL;
+    pool.transparent_index = has_extension ? (unsigned char)extension[3] : -1;
+    pool.compress_options = compress_options;
+    pool.njobs = tiles_x*tiles_y;
+    pool.next_job = 0;
+    pool.error = NULL;
+    pool.jobs = new tile_job[pool.njobs];
+    LOKI_ON_BLOCK_EXIT(free_tile_jobs, pool.jobs);
+
+    for (int i = 0; i < tiles_y; i++) {
+        for (int j = 0; j < tiles_x; j++) {
+            Rect &r = pool.jobs[i*tiles_x + j].rect;
+            r.x = j*tile_width;
+            r.y = i*tile_height;
+            r.w = (r.x + tile_width > width) ? width - r.x : tile_width;
+            r.h = (r.y + tile_height > height) ? height - r.y : tile_height;
+        }
+    }
+
+    int nthreads = tile_threads > 0 ? tile_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > pool.njobs) nthreads = pool.njobs;
+    if (nthreads < 1) nthreads = 1;
+
+    uv_mutex_init(&pool.lock);
+    LOKI_ON_BLOCK_EXIT(uv_mutex_destroy, &pool.lock);
+
+    // the calling thread works through the tiles too
+    std::vector<uv_thread_t> threads(nthreads - 1);
+    int started = 0;
+    for (; started < nthreads - 1; started++) {
+        if (uv_thread_create(&threads[started], tile_worker, &pool) != 0)
+            break;
+    }
+    tile_worker(&pool);
+    for (int i = 0; i < started; i++)
+        uv_thread_join(&threads[i]);
+
+    if (pool.error)
+        throw pool.error;
+
+    for (int i = 0; i < pool.njobs; i++) {
+        std::vector<GifImage::Chunk> &chunks = pool.jobs[i].block.chunks;
+        for (size_t j = 0; j < chunks.size(); j++) {
+            if (output_func(gif_file, chunks[j].data, chunks[j].used) != chunks[j].used)
+                throw "writing tiles in GifEncoder::encode_tiled failed";
+        }
+    }
+}
+
+void
+GifEncoder::set_tiles(int ttile_width, int ttile_height, int tthreads)
+{
+    tile_width = ttile_width;
+    tile_height = ttile_height;
+    tile_threads = tthreads;
+}
+
+void
+GifEncoder::set_lossy(int error)
+{
+    compress_options.lossy_error = error;
+}
+
+void
+GifEncoder::set_clear_threshold(int threshold)
+{
+    compress_options.clear_threshold = threshold;
+}
+
+void
+GifEncoder::set_output_func(OutputFunc func, void *user_data)
+{
+    output_func = func;
+    output_data = user_data;
+}
+
+int
+GifEncoder::max_gif_size(int width, int height, int color_map_size, int images)
+{
+    // LZW never needs more than one code of at most 12 bits per pixel, plus
+    // a clear code each time the 4096 entry table fills up, and clear and
+    // end of information codes around every image.
+    long long pixels = (long long)width*height;
+    long long codes = pixels + pixels/(4096 - 258) + 4*images;
+    long long lzw = (codes*12 + 7)/8 + images;
+    long long sub_blocks = lzw + lzw/255 + 2*images; // length bytes and terminators
+
+    long long size = 6 + 7 + 3*nearest_pow2(std::max(color_map_size, 2)) // header, screen, colors
+        + (8 + 10 + 1)*images // GCE, image descriptor, LZW code size
+        + sub_blocks
+        + 1; // trailer
+    return size > INT_MAX ? INT_MAX : (int)size;
+}
+
 void
 GifEncoder::set_transparency_color(unsigned char r, unsigned char g, unsigned char b)
 {
@@ -223,7 +679,7 @@ GifEncoder::set_transparency_color(const Color &c)
 const unsigned char *
 GifEncoder::get_gif() const
 {
-    return gif.gif;
+    return gif.data();
 }
 
 const int
@@ -232,18 +688,117 @@ GifEncoder::get_gif_len() const
     return gif.size;
 }
 
+unsigned char *
+GifEncoder::release_gif()
+{
+    return gif.release();
+}
+
+// A frame handed to the frame_pool. Its images come back as blocks
+// without their graphics control extensions, which are only written when
+// the frame is, as a repeat may still add to its delay.
+struct frame_job {
+    std::vector<Rect> rects;
+    std::vector<GifByteType *> pixels;
+    std::vector<GifImage *> blocks;
+    char flags, transparent;
+    int delay;
+    int subscriber_limit;
+    CompressOptions options;
+    bool done;
+    const char *error;
+
+    frame_job() : done(false), error(NULL) {}
+    ~frame_job()
+    {
+        for (size_t i = 0; i < pixels.size(); i++)
+            free(pixels[i]);
+        for (size_t i = 0; i < blocks.size(); i++)
+            delete blocks[i];
+    }
+};
+
+static void
+free_frame_job(frame_job *job)
+{
+    delete job;
+}
+
+struct frame_pool {
+    ColorMapObject *color_map;
+    int color_map_size;
+
+    std::vector<uv_thread_t> threads;
+    uv_mutex_t lock;
+    uv_cond_t work, done;
+    std::deque<frame_job *> queue; // waiting for a thread
+    std::deque<frame_job *> jobs;  // all of them, in frame order
+    bool stopping;
+};
+
+static void
+frame_worker(void *arg)
+{
+    frame_pool *pool = (frame_pool *)arg;
+
+    uv_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->queue.empty() && !pool->stopping)
+            uv_cond_wait(&pool->work, &pool->lock);
+        if (pool->stopping)
+            break;
+
+        frame_job *job = pool->queue.front();
+        pool->queue.pop_front();
+        uv_mutex_unlock(&pool->lock);
+
+        try {
+            for (size_t i = 0; i < job->rects.size(); i++) {
+                const Rect &r = job->rects[i];
+                put_image_block(*job->blocks[i], pool->color_map, pool->color_map_size,
+                    NULL, (job->flags & 1) ? (unsigned char)job->transparent : -1,
+                    job->options, r.x, r.y, r.w, r.h, job->pixels[i]);
+                free(job->pixels[i]);
+                job->pixels[i] = NULL;
+            }
+        }
+        catch (const char *err) {
+            job->error = err;
+        }
+
+        uv_mutex_lock(&pool->lock);
+        job->done = true;
+        uv_cond_broadcast(&pool->done);
+    }
+    uv_mutex_unlock(&pool->lock);
+}
+
 // Animated Gif Encoder
 AnimatedGifEncoder::AnimatedGifEncoder(int wwidth, int hheight, buffer_type bbuf_type) :
     width(wwidth), height(hheight), buf_type(bbuf_type),
-    gif_buf(NULL), output_color_map(NULL), gif_file(NULL), color_map_size(256), write_func(0), write_user_data(0),
-    headers_set(false) {}
+    gif_buf(NULL), prev_data(NULL), prev_data_valid(false), output_color_map(NULL), gif_file(NULL), color_map_size(256),
+    headers_set(false), delta_transparency(false), max_images(1),
+    shared_file_writer(false), map_file(false), index_file(NULL), memory_output(-1), to_memory(false),
+    bytes_written(0), frame_count(0), holding(false), frame_held(false),
+    frame_func(NULL), frame_user_data(NULL),
+    frame_threads(-1), pool(NULL),
+    canvas(NULL), broadcast(false), keyframe_ready(false), next_subscriber_id(0) {}
 
 AnimatedGifEncoder::~AnimatedGifEncoder() { end_encoding(); }
 
 void
 AnimatedGifEncoder::end_encoding() {
+    // without finish() there's no one left to tell about the frame, nor
+    // about those still being compressed
+    stop_pool();
+    release_frame(false);
     free(gif_buf);
     gif_buf = NULL;
+    free(prev_data);
+    prev_data = NULL;
+    free(canvas);
+    canvas = NULL;
+    keyframe_ready = false;
     if (output_color_map) {
         GifFreeMapObject(output_color_map);
         output_color_map = NULL;
@@ -252,36 +807,549 @@ AnimatedGifEncoder::end_encoding() {
         EGifCloseFile(gif_file);
         gif_file = NULL;
     }
+    stream.flush();
+    for (std::map<int, GifSink>::iterator it = subscribers.begin(); it != subscribers.end(); ++it)
+        it->second.flush();
+    if (index_file) {
+        fclose(index_file);
+        index_file = NULL;
+    }
+}
+
+int
+AnimatedGifEncoder::output_writer(GifFileType *gif_file, const GifByteType *data, int size)
+{
+    AnimatedGifEncoder *encoder = (AnimatedGifEncoder *)gif_file->UserData;
+    if (encoder->holding) {
+        encoder->held.insert(encoder->held.end(), data, data + size);
+        return size;
+    }
+    return encoder->write_output(data, size) ? size : 0;
+}
+
+bool
+AnimatedGifEncoder::write_output(const unsigned char *data, int size, int subscriber_limit)
+{
+    bool ok = true;
+    if (stream.func && !stream.write(data, size))
+        ok = false;
+    if (out_file.is_open() && !out_file.write(data, size))
+        ok = false;
+    if (mapped_file.is_open() && !mapped_file.write(data, size))
+        ok = false;
+    if (to_memory)
+        gif.append(data, size);
+    if (!ok)
+        return false;
+    bytes_written += size;
+
+    if (broadcast) {
+        if (!headers_set)
+            header.insert(header.end(), data, data + size);
+
+        // a subscriber that can't keep up is dropped, the rest go on
+        for (std::map<int, GifSink>::iterator it = subscribers.begin(); it != subscribers.end();) {
+            if (it->first >= subscriber_limit || it->second.write(data, size))
+                ++it;
+            else
+                subscribers.erase(it++);
+        }
+    }
+    return true;
+}
+
+// Finds the first pixel of a row that would change the screen, i.e.
+// differs from it and isn't transparent. n if there's none.
+static int
+first_changed(const unsigned char *row, const unsigned char *screen, int n,
+    int transparent_index)
+{
+    int i = 0;
+#ifdef __SSE2__
+    // 16 pixels at a time until a block has a changed one
+    __m128i transparent = _mm_set1_epi8((char)transparent_index);
+    for (; i + 16 <= n; i += 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i same = _mm_cmpeq_epi8(cur, _mm_loadu_si128((const __m128i *)(screen + i)));
+        if (transparent_index >= 0)
+            same = _mm_or_si128(same, _mm_cmpeq_epi8(cur, transparent));
+        if (_mm_movemask_epi8(same) != 0xffff)
+            break;
+    }
+#endif
+    for (; i < n; i++) {
+        if (row[i] != screen[i] && row[i] != transparent_index)
+            break;
+    }
+    return i;
+}
+
+// the first and last pixel of a row that change the screen, false if none do
+static bool
+changed_span(const unsigned char *row, const unsigned char *screen, int n,
+    int transparent_index, int *first, int *last)
+{
+    int i = first_changed(row, screen, n, transparent_index);
+    if (i == n)
+        return false;
+
+    int j = n;
+#ifdef __SSE2__
+    __m128i transparent = _mm_set1_epi8((char)transparent_index);
+    for (; j - 16 > i; j -= 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i *)(row + j - 16));
+        __m128i same = _mm_cmpeq_epi8(cur, _mm_loadu_si128((const __m128i *)(screen + j - 16)));
+        if (transparent_index >= 0)
+            same = _mm_or_si128(same, _mm_cmpeq_epi8(cur, transparent));
+        if (_mm_movemask_epi8(same) != 0xffff)
+            break;
+    }
+#endif
+    for (j--; j > i; j--) {
+        if (row[j] != screen[j] && row[j] != transparent_index)
+            break;
+    }
+    *first = i;
+    *last = j;
+    return true;
+}
+
+// Copies a row, with the pixels that are the same as on the screen
+// replaced by the transparent index.
+static void
+substitute_unchanged(const unsigned char *row, const unsigned char *screen, int n,
+    int transparent_index, unsigned char *out)
+{
+    int i = 0;
+#ifdef __SSE2__
+    __m128i transparent = _mm_set1_epi8((char)transparent_index);
+    for (; i + 16 <= n; i += 16) {
+        __m128i cur = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i same = _mm_cmpeq_epi8(cur, _mm_loadu_si128((const __m128i *)(screen + i)));
+        __m128i res = _mm_or_si128(_mm_and_si128(same, transparent), _mm_andnot_si128(same, cur));
+        _mm_storeu_si128((__m128i *)(out + i), res);
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = row[i] == screen[i] ? transparent_index : row[i];
+}
+
+// the bounding box of the pixels of gif_buf inside area that change the
+// canvas, a null rect if none do
+Rect
+AnimatedGifEncoder::changed_box(int transparent_index, const Rect &area) const
+{
+    int left = area.w, right = -1, top = -1, bottom = -1;
+    for (int y = area.y; y < area.y + area.h; y++) {
+        int first, last;
+        if (!changed_span(gif_buf + y*width + area.x, canvas + y*width + area.x,
+            area.w, transparent_index, &first, &last))
+        {
+            continue;
+        }
+        if (top < 0)
+            top = y;
+        bottom = y;
+        left = std::min(left, first);
+        right = std::max(right, last);
+    }
+    if (top < 0)
+        return Rect(0, 0, 0, 0);
+    return Rect(area.x + left, top, right - left + 1, bottom - top + 1);
+}
+
+#define DIRTY_TILE 16
+#define MAX_DIRTY_RUNS 64   // more and the frame just gets one box
+#define MAX_DIRTY_RECTS 4   // images per frame
+#define IMAGE_DELAY 2       // of all but the last image of a frame
+#define MERGE_WASTE (4*DIRTY_TILE*DIRTY_TILE) // pixels an extra image is worth
+
+static Rect
+rect_union(const Rect &a, const Rect &b)
+{
+    int x = std::min(a.x, b.x), y = std::min(a.y, b.y);
+    return Rect(x, y,
+        std::max(a.x + a.w, b.x + b.w) - x,
+        std::max(a.y + a.h, b.y + b.h) - y);
+}
+
+// Merges rects down to at most max_rects, and further as long as a merge
+// wastes few pixels. With too many of them there's just one box.
+static void
+merge_rects(std::vector<Rect> &rects, int max_rects)
+{
+    if (rects.empty())
+        return;
+    if (rects.size() > MAX_DIRTY_RUNS || max_rects <= 1) {
+        Rect all = rects[0];
+        for (size_t i = 1; i < rects.size(); i++)
+            all = rect_union(all, rects[i]);
+        rects.assign(1, all);
+    }
+
+    for (;;) {
+        size_t best_i = 0, best_j = 0;
+        long long best_waste = -1;
+        for (size_t i = 0; i < rects.size(); i++) {
+            for (size_t j = i + 1; j < rects.size(); j++) {
+                Rect u = rect_union(rects[i], rects[j]);
+                long long waste = (long long)u.w*u.h -
+                    (long long)rects[i].w*rects[i].h - (long long)rects[j].w*rects[j].h;
+                if (best_waste < 0 || waste < best_waste) {
+                    best_waste = waste;
+                    best_i = i;
+                    best_j = j;
+                }
+            }
+        }
+        if (best_waste < 0 || (rects.size() <= (size_t)max_rects && best_waste > MERGE_WASTE))
+            break;
+        rects[best_i] = rect_union(rects[best_i], rects[best_j]);
+        rects.erase(rects.begin() + best_j);
+    }
+}
+
+// Splits the pixels inside area that change the canvas into at most
+// max_rects rectangles. The changed 16x16 tiles are joined into runs and
+// columns of runs, which are then merged as long as that wastes little or
+// there are too many of them. Each rectangle ends up as the bounding box
+// of the changed pixels in it.
+void
+AnimatedGifEncoder::dirty_rects(int transparent_index, const Rect &area,
+    int max_rects, std::vector<Rect> &rects) const
+{
+    rects.clear();
+    if (!canvas) {
+        rects.push_back(Rect(0, 0, width, height));
+        return;
+    }
+    if (area.w <= 0 || area.h <= 0)
+        return;
+
+    // the tiles stay on the screen's grid, cut to the area
+    int area_right = area.x + area.w, area_bottom = area.y + area.h;
+    int first_tile_col = area.x/DIRTY_TILE, last_tile_col = (area_right - 1)/DIRTY_TILE;
+    int first_tile_row = area.y/DIRTY_TILE, last_tile_row = (area_bottom - 1)/DIRTY_TILE;
+    int tiles_x = last_tile_col - first_tile_col + 1;
+    std::vector<char> dirty(tiles_x*(last_tile_row - first_tile_row + 1), 0);
+    for (int y = area.y; y < area_bottom; y++) {
+        char *tile_row = &dirty[(y/DIRTY_TILE - first_tile_row)*tiles_x];
+        for (int tx = 0; tx < tiles_x; tx++) {
+            if (tile_row[tx])
+                continue;
+            int x = std::max((first_tile_col + tx)*DIRTY_TILE, area.x);
+            int n = std::min((first_tile_col + tx + 1)*DIRTY_TILE, area_right) - x;
+            if (first_changed(gif_buf + y*width + x, canvas + y*width + x, n, transparent_index) < n)
+                tile_row[tx] = 1;
+        }
+    }
+
+    // runs of changed tiles, in tiles, a run right below one of the same
+    // width extends it
+    std::vector<Rect> runs;
+    for (int ty = first_tile_row; ty <= last_tile_row; ty++) {
+        const char *tile_row = &dirty[(ty - first_tile_row)*tiles_x];
+        for (int tx = 0; tx < tiles_x; tx++) {
+            if (!tile_row[tx])
+                continue;
+            int run_start = tx;
+            while (tx < tiles_x && tile_row[tx])
+                tx++;
+            Rect run(first_tile_col + run_start, ty, tx - run_start, 1);
+            size_t i;
+            for (i = 0; i < runs.size(); i++) {
+                if (runs[i].x == run.x && runs[i].w == run.w && runs[i].y + runs[i].h == ty)
+                    break;
+            }
+            if (i < runs.size())
+                runs[i].h++;
+            else
+                runs.push_back(run);
+        }
+    }
+    if (runs.empty())
+        return;
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        Rect &r = runs[i];
+        int x = std::max(r.x*DIRTY_TILE, area.x), y = std::max(r.y*DIRTY_TILE, area.y);
+        r = Rect(x, y,
+            std::min((r.x + r.w)*DIRTY_TILE, area_right) - x,
+            std::min((r.y + r.h)*DIRTY_TILE, area_bottom) - y);
+    }
+    merge_rects(runs, max_rects);
+
+    for (size_t i = 0; i < runs.size(); i++) {
+        Rect box = changed_box(transparent_index, runs[i]);
+        if (!box.isNull())
+            rects.push_back(box);
+    }
+}
+
+void
+AnimatedGifEncoder::update_canvas(const Rect &rect, int transparent_index)
+{
+    keyframe_ready = false;
+    if (!canvas) {
+        canvas = BufferPool::alloc(width*height);
+        if (!canvas) throw "malloc in AnimatedGifEncoder::update_canvas failed";
+        memcpy(canvas, gif_buf, width*height);
+        return;
+    }
+    for (int y = rect.y; y < rect.y + rect.h; y++) {
+        const unsigned char *src = gif_buf + y*width + rect.x;
+        unsigned char *dst = canvas + y*width + rect.x;
+        if (transparent_index < 0) {
+            memcpy(dst, src, rect.w);
+            continue;
+        }
+        for (int x = 0; x < rect.w; x++) {
+            if (src[x] != transparent_index)
+                dst[x] = src[x];
+        }
+    }
+}
+
+void
+AnimatedGifEncoder::encode_keyframe()
+{
+    keyframe.truncate(0);
+    put_image_block(keyframe, output_color_map, color_map_size, keyframe_extension,
+        (keyframe_extension[0] & 1) ? (unsigned char)keyframe_extension[3] : -1,
+        compress_options, 0, 0, width, height, canvas);
+    keyframe_ready = true;
+}
+
+void
+AnimatedGifEncoder::end_frame(long long offset, int delay)
+{
+    if (!stream.flush())
+        throw "writing to output in AnimatedGifEncoder::new_frame failed";
+    for (std::map<int, GifSink>::iterator it = subscribers.begin(); it != subscribers.end();) {
+        if (it->second.flush())
+            ++it;
+        else
+            subscribers.erase(it++);
+    }
+
+    FrameInfo info;
+    info.frame = frame_count++;
+    info.offset = offset;
+    info.length = bytes_written - offset;
+    info.delay = delay;
+
+    if (index_file) {
+        unsigned char record[16] = { 0 };
+        for (int i = 0; i < 8; i++)
+            record[i] = (info.offset >> 8*i) & 0xff;
+        for (int i = 0; i < 4; i++)
+            record[8 + i] = (info.length >> 8*i) & 0xff;
+        record[12] = info.delay & 0xff;
+        record[13] = (info.delay >> 8) & 0xff;
+        if (fwrite(record, sizeof(record), 1, index_file) != 1)
+            throw "writing to index file in AnimatedGifEncoder::new_frame failed";
+    }
+
+    if (frame_func)
+        frame_func(frame_user_data, info);
+}
+
+// the web safe colors of n pixels
+void
+AnimatedGifEncoder::quantize_span(const unsigned char *pixels, int n, GifByteType *out,
+    int from, int to)
+{
+    int pixel_size = (buf_type == BUF_RGBA || buf_type == BUF_BGRA) ? 4 : 3;
+    int r = (buf_type == BUF_BGR || buf_type == BUF_BGRA) ? 2 : 0;
+    if ((int)planes.size() < 3*n)
+        planes.resize(3*n);
+    GifByteType *red = &planes[0], *green = red + n, *blue = green + n;
+    for (int i = 0; i < n; i++, pixels += pixel_size) {
+        red[i] = pixels[r];
+        green[i] = pixels[1];
+        blue[i] = pixels[2 - r];
+    }
+    if (web_safe_quantize(n, 1, red, green, blue, out, quantize_cache) == GIF_ERROR)
+        throw "web_safe_quantize in AnimatedGifEncoder::new_frame failed";
+    for (int i = 0; from >= 0 && i < n; i++) {
+        if (out[i] == from)
+            out[i] = to;
+    }
 }
 
 void
 AnimatedGifEncoder::new_frame(unsigned char *data, int delay)
+{
+    encode_frame(data, delay, NULL);
+}
+
+void
+AnimatedGifEncoder::new_frame(unsigned char *data, int delay, const std::vector<Rect> &changed)
+{
+    encode_frame(data, delay, &changed);
+}
+
+void
+AnimatedGifEncoder::encode_frame(unsigned char *data, int delay, const std::vector<Rect> *changed)
 {
     if (!gif_file) {
-       if (write_func != NULL) {
-            int nError;
-            gif_file = EGifOpen(write_user_data, write_func, &nError);
-            if (!gif_file) throw "EGifOpen in AnimatedGifEncoder::new_frame failed";
-        } else if (file_name.empty()) { // memory writer
-            int nError;
-            gif_file = EGifOpen(&gif, gif_writer, &nError);
-            if (!gif_file) throw "EGifOpen in AnimatedGifEncoder::new_frame failed";
-        } else {
-            int nError;
-            gif_file = EGifOpenFileName(file_name.c_str(), FALSE, &nError);
-            if (!gif_file) throw "EGifOpenFileName in AnimatedGifEncoder::new_frame failed";
+        if (!file_name.empty()) {
+            if (map_file) {
+                if (!mapped_file.open(file_name.c_str())) throw mapped_file.get_error();
+            }
+            else {
+                if (!out_file.open(file_name.c_str(), shared_file_writer)) throw out_file.get_error();
+            }
+            if (!index_file_name.empty()) {
+                index_file = fopen(index_file_name.c_str(), "wb");
+                if (!index_file) throw "fopen of index file in AnimatedGifEncoder::new_frame failed";
+            }
         }
+        if (memory_output < 0)
+            to_memory = stream.func == NULL && file_name.empty() && !broadcast;
+        else
+            to_memory = memory_output;
+        if (to_memory)
+            gif.reserve(width*height/4 + 1024);
+
+        int nError;
+        gif_file = EGifOpen(this, output_writer, &nError);
+        if (!gif_file) throw "EGifOpen in AnimatedGifEncoder::new_frame failed";
+        compress_options.apply(gif_file);
+
         output_color_map = GifMakeMapObject(color_map_size, ext_web_safe_palette);
         if (!output_color_map) throw "MakeMapObject in AnimatedGifEncoder::new_frame failed";
 
-        gif_buf = (GifByteType *)malloc(sizeof(GifByteType)*width*height);
+        gif_buf = BufferPool::alloc(sizeof(GifByteType)*width*height);
         if (!gif_buf) throw "malloc in AnimatedGifEncoder::new_frame failed";
+
+        if (frame_threads >= 0)
+            start_pool();
     }
 
-    RGBator rgb(data, width, height, buf_type);
+    // rows that are the same as in the last frame quantize the same, so
+    // only the band of rows from the first to the last changed one is done.
+    // When the caller says what changed there's no need to look for it:
+    // only its rectangles get quantized, and only what of them changes the
+    // screen is encoded. That needs a screen to change.
+    int pixel_size = (buf_type == BUF_RGBA || buf_type == BUF_BGRA) ? 4 : 3;
+    int row_size = width*pixel_size;
+    int band_top = 0, band_bottom = height - 1;
+    bool hinted = changed && canvas;
+    bool have_prev = prev_data != NULL && prev_data_valid;
+    std::vector<Rect> rects;
+    if (!prev_data) {
+        // aligned and, for big screens, on huge pages: it's compared
+        // against every frame
+        prev_data = BufferPool::alloc(height*row_size);
+        if (!prev_data) throw "malloc in AnimatedGifEncoder::new_frame failed";
+    }
+    if (hinted) {
+        for (size_t i = 0; i < changed->size(); i++) {
+            const Rect &c = (*changed)[i];
+            int x = std::max(c.x, 0), y = std::max(c.y, 0);
+            int w = std::min(c.x + c.w, width) - x, h = std::min(c.y + c.h, height) - y;
+            if (w > 0 && h > 0)
+                rects.push_back(Rect(x, y, w, h));
+        }
+        // what's outside the rectangles isn't looked at, so the next frame
+        // without them can't go by prev_data
+        prev_data_valid = false;
+    }
+    else if (have_prev) {
+        while (band_top < height &&
+            !memcmp(data + band_top*row_size, prev_data + band_top*row_size, row_size))
+        {
+            band_top++;
+        }
+        while (band_bottom >= band_top &&
+            !memcmp(data + band_bottom*row_size, prev_data + band_bottom*row_size, row_size))
+        {
+            band_bottom--;
+        }
+    }
 
-    if (web_safe_quantize(width, height, rgb.red, rgb.green, rgb.blue, gif_buf) == GIF_ERROR)
-        throw "web_safe_quantize in AnimatedGifEncoder::new_frame failed";
+    int band_rows = band_bottom - band_top + 1;
+
+    char frame_flags = 1 << 2;
+    char transp_color_idx = 0;
+    if (transparency_color.color_present || delta_transparency) {
+        Color palette_transparent(0xFF, 0xFF, 0xFE);
+        int i = find_color_index(output_color_map, color_map_size,
+            transparency_color.color_present ? transparency_color : palette_transparent);
+        if (i>=0) {
+            frame_flags |= 1;
+            transp_color_idx = i;
+        }
+    }
+    int transparent_index = (frame_flags & 1) ? (unsigned char)transp_color_idx : -1;
+    // Decoders show every image for its own delay, and browsers stretch
+    // delays under 2 to 10, so images before the last get IMAGE_DELAY each
+    // and the frame is split only when asked to and only as much as its
+    // delay can pay for.
+    int max_rects = std::max(1, std::min(std::min(max_images, MAX_DIRTY_RECTS),
+        delay/IMAGE_DELAY));
+
+    // the palette's transparent color is only borrowed for delta
+    // transparency, pixels of that color are drawn white instead
+    int from = -1, to = -1;
+    if (delta_transparency && !transparency_color.color_present) {
+        Color palette_transparent(0xFF, 0xFF, 0xFE), white(0xFF, 0xFF, 0xFF);
+        from = find_color_index(output_color_map, color_map_size, palette_transparent);
+        to = find_color_index(output_color_map, color_map_size, white);
+    }
+
+    if (hinted) {
+        std::vector<Rect> pushed, found;
+        pushed.swap(rects);
+        for (size_t i = 0; i < pushed.size(); i++) {
+            const Rect &r = pushed[i];
+            for (int y = r.y; y < r.y + r.h; y++) {
+                quantize_span(data + y*row_size + r.x*pixel_size, r.w,
+                    gif_buf + y*width + r.x, from, to);
+            }
+            dirty_rects(transparent_index, r, max_rects, found);
+            rects.insert(rects.end(), found.begin(), found.end());
+        }
+        merge_rects(rects, max_rects);
+    }
+    bool same = hinted ? rects.empty() : band_rows <= 0;
+
+    // the same frame again, the held back one just stays up longer
+    bool hold = holds_frames();
+    if (same && hold && pool && !pool->jobs.empty() && pool->jobs.back()->delay + delay <= 0xffff) {
+        pool->jobs.back()->delay += delay;
+        return;
+    }
+    if (same && hold && frame_held && held_delay + delay <= 0xffff) {
+        int last_delay = (held[held_delay_at] | held[held_delay_at + 1] << 8) + delay;
+        held[held_delay_at] = last_delay & 0xff;
+        held[held_delay_at + 1] = last_delay >> 8;
+        held_delay += delay;
+        return;
+    }
+
+    if (!hinted) {
+        // and of those rows only the pixels from the first to the last
+        // changed one, with colors remembered from frame to frame
+        for (int y = band_top; y <= band_bottom; y++) {
+            unsigned char *row = data + y*row_size, *prev_row = prev_data + y*row_size;
+            int first = 0, last = row_size - 1;
+            if (have_prev) {
+                while (first < row_size && row[first] == prev_row[first])
+                    first++;
+                if (first == row_size)
+                    continue;
+                while (row[last] == prev_row[last])
+                    last--;
+            }
+            first /= pixel_size;
+            last /= pixel_size;
+            memcpy(prev_row + first*pixel_size, row + first*pixel_size, (last - first + 1)*pixel_size);
+            quantize_span(row + first*pixel_size, last - first + 1, gif_buf + y*width + first, from, to);
+        }
+        prev_data_valid = true;
+    }
 
     /*
     if (QuantizeBuffer(width, height, &color_map_size,
@@ -305,40 +1373,277 @@ AnimatedGifEncoder::new_frame(unsigned char *data, int delay)
         headers_set = true;
     }
 
-    char frame_flags = 1 << 2;
-    char transp_color_idx = 0;
-    if (transparency_color.color_present) {
-        int i = find_color_index(output_color_map, color_map_size, transparency_color);
-        if (i>=0) {
-            frame_flags |= 1;
-            transp_color_idx = i;
+    release_frame();
+
+    // frames aren't disposed of, so only the parts that change the screen
+    // need encoding. A gif image can't be empty, one pixel it is then,
+    // transparent when it can be: a repeat that only adds its delay.
+    std::vector<GifByteType> line;
+    if (!hinted)
+        dirty_rects(transparent_index, Rect(0, band_top, width, band_rows), max_rects, rects);
+    bool noop = rects.empty() && transparent_index >= 0;
+    if (rects.empty())
+        rects.push_back(Rect(0, 0, 1, 1));
+
+    if (pool) {
+        // the images are compressed on a worker, from copies of their pixels
+        frame_job *job = new frame_job;
+        Loki::ScopeGuard free_job = Loki::MakeGuard(free_frame_job, job);
+        job->flags = frame_flags;
+        job->transparent = transp_color_idx;
+        job->delay = delay;
+        job->subscriber_limit = next_subscriber_id;
+        job->options = compress_options;
+        for (size_t r = 0; r < rects.size(); r++) {
+            const Rect &rect = rects[r];
+            GifByteType *pixels = (GifByteType *)malloc(rect.w*rect.h);
+            if (!pixels) throw "malloc in AnimatedGifEncoder::new_frame failed";
+            job->rects.push_back(rect);
+            job->pixels.push_back(pixels);
+            job->blocks.push_back(new GifImage);
+
+            GifByteType *gif_bufp = gif_buf + rect.y*width + rect.x;
+            unsigned char *canvasp = canvas ? canvas + rect.y*width + rect.x : NULL;
+            bool substitute = delta_transparency && canvasp && transparent_index >= 0;
+            for (int i = 0; i < rect.h; i++) {
+                if (noop) {
+                    pixels[0] = transparent_index;
+                }
+                else if (substitute) {
+                    substitute_unchanged(gif_bufp, canvasp, rect.w, transparent_index, pixels);
+                    canvasp += width;
+                }
+                else {
+                    memcpy(pixels, gif_bufp, rect.w);
+                }
+                pixels += rect.w;
+                gif_bufp += width;
+            }
         }
+        if (broadcast) {
+            int image_delay = delay - IMAGE_DELAY*(int)(rects.size() - 1);
+            char extension[] = { frame_flags, image_delay%256, image_delay/256, transp_color_idx };
+            memcpy(keyframe_extension, extension, sizeof(extension));
+        }
+
+        uv_mutex_lock(&pool->lock);
+        pool->jobs.push_back(job);
+        pool->queue.push_back(job);
+        uv_cond_signal(&pool->work);
+        uv_mutex_unlock(&pool->lock);
+        free_job.Dismiss();
     }
+    else {
+        holding = true;
+        for (size_t r = 0; r < rects.size(); r++) {
+            const Rect &rect = rects[r];
+            int image_delay = r + 1 < rects.size() ? IMAGE_DELAY :
+                delay - IMAGE_DELAY*(int)(rects.size() - 1);
+            char extension[] = {
+                frame_flags,
+                image_delay%256, image_delay/256,
+                transp_color_idx
+            };
+            held_delay_at = held.size() + 4; // after 0x21 0xf9, size and flags
+            EGifPutExtension(gif_file, GRAPHICS_EXT_FUNC_CODE, 4, extension);
+            EGifSetTransparentIndex(gif_file, transparent_index);
+            if (broadcast)
+                memcpy(keyframe_extension, extension, sizeof(extension));
 
-    char extension[] = {
-        frame_flags,
-        delay%256, delay/256,
-        transp_color_idx
-    };
-    EGifPutExtension(gif_file, GRAPHICS_EXT_FUNC_CODE, 4, extension);
+            if (EGifPutImageDesc(gif_file, rect.x, rect.y, rect.w, rect.h, FALSE, NULL) == GIF_ERROR) {
+                throw "EGifPutImageDesc in AnimatedGifEncoder::new_frame failed";
+            }
 
-    if (EGifPutImageDesc(gif_file, 0, 0, width, height, FALSE, NULL) == GIF_ERROR) {
-        throw "EGifPutImageDesc in AnimatedGifEncoder::new_frame failed";
+            GifByteType *gif_bufp = gif_buf + rect.y*width + rect.x;
+            unsigned char *canvasp = canvas ? canvas + rect.y*width + rect.x : NULL;
+            bool substitute = delta_transparency && canvasp && transparent_index >= 0;
+            if (substitute || noop)
+                line.resize(rect.w);
+            for (int i = 0; i < rect.h; i++) {
+                GifByteType *linep = gif_bufp;
+                if (noop) {
+                    line[0] = transparent_index;
+                    linep = &line[0];
+                }
+                else if (substitute) {
+                    substitute_unchanged(gif_bufp, canvasp, rect.w, transparent_index, &line[0]);
+                    linep = &line[0];
+                    canvasp += width;
+                }
+                if (EGifPutLine(gif_file, linep, rect.w) == GIF_ERROR) {
+                    throw "EGifPutLine in AnimatedGifEncoder::new_frame failed";
+                }
+                gif_bufp += width;
+            }
+        }
+        holding = false;
+        frame_held = true;
+        held_delay = delay;
+        held_subscribers = next_subscriber_id;
+        if (!hold)
+            release_frame();
     }
+    for (size_t r = 0; !noop && r < rects.size(); r++)
+        update_canvas(rects[r], transparent_index);
 
-    GifByteType *gif_bufp = gif_buf;
-    for (int i = 0; i < height; i++) {
-        if (EGifPutLine(gif_file, gif_bufp, width) == GIF_ERROR) {
-            throw "EGifPutLine in AnimatedGifEncoder::new_frame failed";
+    // the frame before this one can't be repeated any more
+    commit_frames(false);
+}
+
+// frames only wait for a repeat when the gif goes nowhere but memory,
+// anything watching the output gets each one as soon as it's encoded
+bool
+AnimatedGifEncoder::holds_frames() const
+{
+    return to_memory && !stream.func && file_name.empty() && !broadcast && !frame_func;
+}
+
+// writes out the held back frame
+void
+AnimatedGifEncoder::release_frame(bool notify)
+{
+    holding = false;
+    if (!frame_held)
+        return;
+    frame_held = false;
+
+    long long offset = bytes_written;
+    bool ok = write_output(&held[0], held.size(), held_subscribers);
+    held.clear();
+    if (!notify)
+        return;
+    if (!ok)
+        throw "writing to output in AnimatedGifEncoder::new_frame failed";
+    end_frame(offset, held_delay);
+}
+
+void
+AnimatedGifEncoder::start_pool()
+{
+    int nthreads = frame_threads > 0 ? frame_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+
+    pool = new frame_pool;
+    pool->color_map = output_color_map;
+    pool->color_map_size = color_map_size;
+    pool->stopping = false;
+    uv_mutex_init(&pool->lock);
+    uv_cond_init(&pool->work);
+    uv_cond_init(&pool->done);
+
+    pool->threads.resize(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        if (uv_thread_create(&pool->threads[i], frame_worker, pool) != 0) {
+            pool->threads.resize(i);
+            stop_pool();
+            throw "starting a thread in AnimatedGifEncoder::new_frame failed";
         }
-        gif_bufp += width;
     }
 }
 
+// drops the frames that haven't been written out
+void
+AnimatedGifEncoder::stop_pool()
+{
+    if (!pool)
+        return;
+
+    uv_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    uv_cond_broadcast(&pool->work);
+    uv_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->threads.size(); i++)
+        uv_thread_join(&pool->threads[i]);
+
+    for (size_t i = 0; i < pool->jobs.size(); i++)
+        delete pool->jobs[i];
+    uv_cond_destroy(&pool->done);
+    uv_cond_destroy(&pool->work);
+    uv_mutex_destroy(&pool->lock);
+    delete pool;
+    pool = NULL;
+}
+
+// Writes out the compressed frames at the front, in order, through the
+// held frame. The newest one stays, it may yet be repeated - unless all,
+// which waits for every frame. Only a few frames per thread may be queued,
+// after that the caller waits for the oldest.
 void
-AnimatedGifEncoder::finish()
+AnimatedGifEncoder::commit_frames(bool all)
 {
+    if (!pool)
+        return;
+
+    size_t max_jobs = 2*pool->threads.size() + 1;
+    uv_mutex_lock(&pool->lock);
+    // the newest one is kept back too while a repeat may still add to it
+    size_t keep = (all || !holds_frames()) ? 0 : 1;
+    while (pool->jobs.size() > keep) {
+        frame_job *job = pool->jobs.front();
+        if (!job->done) {
+            if (!all && pool->jobs.size() <= max_jobs)
+                break;
+            uv_cond_wait(&pool->done, &pool->lock);
+            continue;
+        }
+        pool->jobs.pop_front();
+        uv_mutex_unlock(&pool->lock);
+
+        LOKI_ON_BLOCK_EXIT(free_frame_job, job);
+        if (job->error)
+            throw job->error;
+        holding = true;
+        for (size_t i = 0; i < job->blocks.size(); i++) {
+            int image_delay = i + 1 < job->blocks.size() ? IMAGE_DELAY :
+                job->delay - IMAGE_DELAY*(int)(job->blocks.size() - 1);
+            char extension[] = {
+                job->flags,
+                image_delay%256, image_delay/256,
+                job->transparent
+            };
+            held_delay_at = held.size() + 4;
+            EGifPutExtension(gif_file, GRAPHICS_EXT_FUNC_CODE, 4, extension);
+            std::vector<GifImage::Chunk> &chunks = job->blocks[i]->chunks;
+            for (size_t j = 0; j < chunks.size(); j++)
+                held.insert(held.end(), chunks[j].data, chunks[j].data + chunks[j].used);
+        }
+        holding = false;
+        frame_held = true;
+        held_delay = job->delay;
+        held_subscribers = job->subscriber_limit;
+        release_frame();
+
+        uv_mutex_lock(&pool->lock);
+    }
+    uv_mutex_unlock(&pool->lock);
+}
+
+void
+AnimatedGifEncoder::finish(bool close_file)
+{
+    commit_frames(true);
+    release_frame();
     end_encoding();
+    gif.flatten();
+    if (close_file && !this->close_file())
+        throw get_file_error();
+}
+
+bool
+AnimatedGifEncoder::close_file()
+{
+    bool ok = out_file.close();
+    if (!mapped_file.close())
+        ok = false;
+    return ok;
+}
+
+const char *
+AnimatedGifEncoder::get_file_error() const
+{
+    if (*mapped_file.get_error())
+        return mapped_file.get_error();
+    return out_file.get_error();
 }
 
 void
@@ -356,10 +1661,40 @@ AnimatedGifEncoder::set_transparency_color(const Color &c)
     transparency_color = c;
 }
 
+void
+AnimatedGifEncoder::set_delta_transparency(bool on)
+{
+    delta_transparency = on;
+}
+
+void
+AnimatedGifEncoder::set_max_images(int images)
+{
+    max_images = images;
+}
+
+void
+AnimatedGifEncoder::set_frame_threads(int threads)
+{
+    frame_threads = threads;
+}
+
+void
+AnimatedGifEncoder::set_lossy(int error)
+{
+    compress_options.lossy_error = error;
+}
+
+void
+AnimatedGifEncoder::set_clear_threshold(int threshold)
+{
+    compress_options.clear_threshold = threshold;
+}
+
 const unsigned char *
 AnimatedGifEncoder::get_gif() const
 {
-    return gif.gif;
+    return gif.data();
 }
 
 const int
@@ -368,15 +1703,90 @@ AnimatedGifEncoder::get_gif_len() const
     return gif.size;
 }
 
+unsigned char *
+AnimatedGifEncoder::release_gif()
+{
+    return gif.release();
+}
+
 void
-AnimatedGifEncoder::set_output_file(const char *ffile_name)
+AnimatedGifEncoder::set_output_file(const char *ffile_name, const char *iindex_file_name)
 {
     file_name = ffile_name;
+    index_file_name = iindex_file_name ? iindex_file_name : "";
+}
+
+void
+AnimatedGifEncoder::set_shared_file_writer(bool shared)
+{
+    shared_file_writer = shared;
+}
+
+void
+AnimatedGifEncoder::set_mapped_file(bool mapped)
+{
+    map_file = mapped;
+}
+
+void
+AnimatedGifEncoder::set_memory_output(bool keep)
+{
+    memory_output = keep;
+}
+
+void
+AnimatedGifEncoder::set_frame_func(FrameFunc func, void *user_data)
+{
+    frame_func = func;
+    frame_user_data = user_data;
+}
+
+void
+AnimatedGifEncoder::set_broadcast()
+{
+    if (gif_file && !broadcast)
+        throw "broadcasting must be turned on before the first frame";
+    broadcast = true;
+}
+
+int
+AnimatedGifEncoder::subscribe(OutputFunc func, void *user_data, int high_water)
+{
+    if (!broadcast)
+        set_broadcast();
+
+    GifSink sink;
+    sink.func = func;
+    sink.user_data = user_data;
+    sink.high_water = high_water;
+
+    // catch up a late subscriber on the current screen
+    if (headers_set) {
+        if (!canvas)
+            throw "AnimatedGifEncoder::subscribe after the broadcast has finished";
+        if (!keyframe_ready)
+            encode_keyframe();
+        bool ok = sink.write(&header[0], header.size());
+        for (size_t i = 0; ok && i < keyframe.chunks.size(); i++)
+            ok = sink.write(keyframe.chunks[i].data, keyframe.chunks[i].used);
+        if (!ok || !sink.flush())
+            throw "writing to subscriber in AnimatedGifEncoder::subscribe failed";
+    }
+
+    subscribers[next_subscriber_id] = sink;
+    return next_subscriber_id++;
+}
+
+void
+AnimatedGifEncoder::unsubscribe(int id)
+{
+    subscribers.erase(id);
 }
 
 void
-AnimatedGifEncoder::set_output_func(OutputFunc func, void *user_data)
+AnimatedGifEncoder::set_output_func(OutputFunc func, void *user_data, int high_water)
 {
-   write_func = func;
-   write_user_data = user_data;
+   stream.func = func;
+   stream.user_data = user_data;
+   stream.high_water = high_water;
 }
@@ -1,27 +1,110 @@
 #ifndef GIF_ENCODER_H
 #define GIF_ENCODER_H
 
+#include <climits>
+#include <cstdio>
+#include <map>
 #include <string>
+#include <vector>
 #include <gif_lib.h>
 
 #include "common.h"
+#include "file_writer.h"
+#include "quantize.h"
 
+// Encoded output. It grows by adding chunks of doubling size, so the bytes
+// already written never move; flatten() joins them into one at the end.
 struct GifImage {
-    int size, mem_size;
-    unsigned char *gif;
+    struct Chunk {
+        unsigned char *data;
+        int size, used;
+    };
+    std::vector<Chunk> chunks;
+    int size, first_chunk_size;
 
     GifImage();
     ~GifImage();
+
+    void reserve(int estimate); // size of the first chunk
+    void append(const unsigned char *data, int len);
+    void truncate(int new_size);
+    void flatten();
+    const unsigned char *data() const; // all of it only once flattened
+    unsigned char *release(); // flattened, malloc'd, now the caller's to free
+
+private:
+    // the chunks are owned, a copy would free them twice
+    GifImage(const GifImage &);
+    GifImage &operator=(const GifImage &);
 };
 
 int gif_writer(GifFileType *gif_file, const GifByteType *data, int size);
 
+// Memory the caller owns, written by fixed_buffer_writer until it is full
+struct FixedBuffer {
+    unsigned char *data;
+    int capacity, size;
+    bool overflow;
+
+    FixedBuffer(unsigned char *ddata, int ccapacity) :
+        data(ddata), capacity(ccapacity), size(0), overflow(false) {}
+};
+
+int fixed_buffer_writer(GifFileType *gif_file, const GifByteType *data, int size);
+
+// An OutputFunc together with a buffer that collects the many small writes
+// giflib makes, so that func sees them in pieces of at least high_water
+// bytes - or less at the end of a frame, when flush() is called.
+struct GifSink {
+    OutputFunc func;
+    void *user_data;
+    int high_water; // 0 passes every write straight on
+    std::vector<unsigned char> pending;
+
+    GifSink() : func(NULL), user_data(NULL), high_water(0) {}
+    bool write(const unsigned char *data, int size);
+    bool flush();
+    bool pass_on(const unsigned char *data, int size);
+};
+
+int sink_writer(GifFileType *gif_file, const GifByteType *data, int size);
+
+// Where a frame ended up in the output: its graphics control extension
+// starts offset bytes into the gif and the image data ends length bytes later.
+struct FrameInfo {
+    int frame;
+    long long offset;
+    int length;
+    int delay;
+};
+
+typedef void (*FrameFunc)(void *user_data, const FrameInfo &frame);
+
+// LZW tuning, applied to every gif file an encoder opens
+struct CompressOptions {
+    int lossy_error;     // max RGB distance of a lossy match, 0 is lossless
+    int clear_threshold; // % a full table may degrade before clearing, 0 clears at once
+
+    CompressOptions() : lossy_error(0), clear_threshold(0) {}
+    void apply(GifFileType *gif_file) const;
+};
+
 class GifEncoder {
     unsigned char *data;
     int width, height;
     buffer_type buf_type;
     GifImage gif;
     Color transparency_color;
+    CompressOptions compress_options;
+
+    int tile_width, tile_height, tile_threads;
+
+    OutputFunc output_func;
+    void *output_data;
+
+    void encode_whole();
+    void encode_tiled();
+    static void tile_worker(void *arg);
 
 public:
     GifEncoder(unsigned char *ddata, int wwidth, int hheight, buffer_type bbuf_type);
@@ -29,44 +112,166 @@ public:
     void set_transparency_color(unsigned char r, unsigned char g, unsigned char b);
     void set_transparency_color(const Color &c);
 
+    // split the canvas into tiles, each compressed on its own thread as
+    // a separate image descriptor. threads=0 uses one thread per cpu.
+    void set_tiles(int ttile_width, int ttile_height, int tthreads=0);
+
+    // let LZW substitute colors within this RGB distance, 0 is lossless.
+    void set_lossy(int error);
+    // keep a full LZW table until it does threshold% worse than when it was built.
+    void set_clear_threshold(int threshold);
+
+    // write through func instead of collecting the gif for get_gif()
+    void set_output_func(OutputFunc func, void *user_data);
+
+    // most bytes encode() can produce for an image of this size, split into
+    // this many image descriptors
+    static int max_gif_size(int width, int height, int color_map_size=256, int images=1);
+
     void encode();
     const unsigned char *get_gif() const;
     const int get_gif_len() const;
+    unsigned char *release_gif(); // take get_gif_len() first, free() when done
 };
 
+struct frame_pool;
+
 class AnimatedGifEncoder {
     int width, height;
     buffer_type buf_type;
     GifImage gif;
 
     unsigned char *gif_buf;
+    unsigned char *prev_data; // last frame as given to new_frame
+    bool prev_data_valid; // not after a frame that came with its changes
+    QuantizeCache quantize_cache;
+    std::vector<GifByteType> planes;
     ColorMapObject *output_color_map;
     GifFileType *gif_file;
     int color_map_size;
 
     bool headers_set;
     Color transparency_color;
+    bool delta_transparency;
+    int max_images; // per frame
+    CompressOptions compress_options;
+
+    // output goes to all of these that are set up: the callback stream,
+    // the file and memory for get_gif()
+    std::string file_name, index_file_name;
+    FileWriter out_file;
+    MappedFile mapped_file;
+    bool shared_file_writer, map_file;
+    FILE *index_file;
+    GifSink stream;
+    int memory_output; // 1 or 0, -1 for only when there's no other output
+    bool to_memory;
+
+    long long bytes_written;
+    int frame_count;
+
+    // with only memory output the last frame is held back until the next
+    // one, which may turn out the same and only add to its delay
+    std::vector<unsigned char> held;
+    bool holding, frame_held;
+    int held_delay;
+    size_t held_delay_at; // of the delay in its last graphics control
+    int held_subscribers; // ids below joined before it, the rest got it in their keyframe
+    FrameFunc frame_func;
+    void *frame_user_data;
 
-    std::string file_name;
-    OutputFunc write_func;
-    void *write_user_data;
+    // frames compressed on worker threads, written out in order
+    int frame_threads; // -1 compresses on the calling thread
+    frame_pool *pool;
 
+    // the screen as all frames so far left it, in color indexes. Frames
+    // only get encoded where they change it.
+    unsigned char *canvas;
+
+    // broadcasting: the header and the canvas are kept so that subscribers
+    // can join the stream at any frame
+    bool broadcast;
+    std::vector<unsigned char> header;
+    char keyframe_extension[4];
+    GifImage keyframe;
+    bool keyframe_ready;
+    std::map<int, GifSink> subscribers;
+    int next_subscriber_id;
+
+    Rect changed_box(int transparent_index, const Rect &area) const;
+    void dirty_rects(int transparent_index, const Rect &area,
+        int max_rects, std::vector<Rect> &rects) const;
+    void update_canvas(const Rect &rect, int transparent_index);
+    void quantize_span(const unsigned char *pixels, int n, GifByteType *out, int from, int to);
+    void encode_frame(unsigned char *data, int delay, const std::vector<Rect> *changed);
+    void encode_keyframe();
     void end_encoding();
+    void end_frame(long long offset, int delay);
+    bool holds_frames() const;
+    void release_frame(bool notify=true);
+    void start_pool();
+    void stop_pool();
+    void commit_frames(bool all);
+    bool write_output(const unsigned char *data, int size, int subscriber_limit=INT_MAX);
+    static int output_writer(GifFileType *gif_file, const GifByteType *data, int size);
 public:
     AnimatedGifEncoder(int wwidth, int hheight, buffer_type bbuf_type);
     ~AnimatedGifEncoder();
 
     void new_frame(unsigned char *data, int delay=0); // delay in 1/100s of a second
-    void finish();
+    // a frame that differs from the last one only inside the changed
+    // rectangles; nothing else of it is looked at
+    void new_frame(unsigned char *data, int delay, const std::vector<Rect> &changed);
+    // with close_file=false the output file is still being written in the
+    // background, until close_file() is called - from any thread.
+    void finish(bool close_file=true);
+    bool close_file();
+    const char *get_file_error() const;
 
     void set_transparency_color(unsigned char r, unsigned char g, unsigned char b);
     void set_transparency_color(const Color &c);
+    void set_lossy(int error);
+    void set_clear_threshold(int threshold);
+    // write the pixels of a frame that are the same as on screen as
+    // transparent, which compresses much better. Without a transparency
+    // color the palette's transparent color 0xFFFFFE is used.
+    void set_delta_transparency(bool on);
+    // let changes far apart go into up to this many images per frame (at
+    // most 4, 1 by default) instead of one box around them all. Decoders
+    // show each image but the last for 1/50s, a half updated screen, which
+    // comes out of the frame's delay, so frames need a delay of 4 or more.
+    void set_max_images(int images);
+    // compress frames on this many threads (0 is one per cpu, -1 none) while the
+    // calling thread goes on with the next ones. They're written out in
+    // order, a few frames behind.
+    void set_frame_threads(int threads);
+
+    // with an index file, every frame also adds a 16 byte FrameInfo record
+    // to it: offset (8 bytes), length (4) and delay (2) little endian, 2 zeros.
+    void set_output_file(const char *ffile_name, const char *iindex_file_name=NULL);
+    // write the file on the thread all shared FileWriters use, batched with
+    // the other encoders' files, instead of on a thread of its own
+    void set_shared_file_writer(bool shared);
+    // write the file through a memory mapping, on the encoding thread
+    void set_mapped_file(bool mapped);
+    void set_output_func(OutputFunc func, void* user_data, int high_water=64*1024);
+    // also keep the gif for get_gif() when writing to a file or func
+    void set_memory_output(bool keep);
+    // called after each frame has been written out
+    void set_frame_func(FrameFunc func, void *user_data);
 
-    void set_output_file(const char *ffile_name);
-    void set_output_func(OutputFunc func, void* user_data);
+    // Broadcast the gif to any number of subscribers, who may join between
+    // any two frames: a late one first gets the header and a full keyframe
+    // of the current screen. Must be turned on before the first frame;
+    // subscribing before the first frame turns it on too. Broadcasting
+    // keeps nothing for get_gif() unless set_memory_output() says so.
+    void set_broadcast();
+    int subscribe(OutputFunc func, void *user_data, int high_water=64*1024);
+    void unsubscribe(int id);
 
     const unsigned char *get_gif() const;
     const int get_gif_len() const;
+    unsigned char *release_gif(); // take get_gif_len() first, free() when done
 };
 
 class RGBator {
@@ -1,6 +1,5 @@
 #include <cstdio>
 #include <cassert>
-#include <map>
 
 #include "common.h"
 #include "quantize.h"
@@ -10,6 +9,19 @@ int
 web_safe_quantize(int width, int height,
     GifByteType *r, GifByteType *g, GifByteType *b,
     GifByteType *out)
+{
+    // no bigger than the image needs
+    int bits = 8;
+    while (bits < QUANTIZE_CACHE_BITS && 1 << bits < width*height)
+        bits++;
+    QuantizeCache cache(bits);
+    return web_safe_quantize(width, height, r, g, b, out, cache);
+}
+
+int
+web_safe_quantize(int width, int height,
+    GifByteType *r, GifByteType *g, GifByteType *b,
+    GifByteType *out, QuantizeCache &cache)
 {
     assert(width);
     assert(height);
@@ -19,24 +31,19 @@ web_safe_quantize(int width, int height,
     assert(out);
 
     // naive quantization
-    
-    typedef std::map<int, char> IdxCache;
-    IdxCache cache;
 
     for (int i = 0; i < height; i++) {
         for (int j = 0; j < width; j++) {
-            IdxCache::iterator idx = cache.find(*r<<16 | *g<<8 | *b);
-            if (idx != cache.end()) {
-                *out++ = idx->second;
-                r++; g++; b++;
-                continue;
+            unsigned int color = 1 << 24 | *r<<16 | *g<<8 | *b;
+            int slot = cache.slot(color);
+            if (cache.colors[slot] != color) {
+                cache.colors[slot] = color;
+                cache.indexes[slot] = find_closest_color(*r, *g, *b); // hidden for 255..0 loop!
             }
-            *out = find_closest_color(*r, *g, *b); // hidden for 255..0 loop!
-            cache[*r<<16 | *g<<8 | *b] = *out;
-            out++; r++; g++; b++;
+            *out++ = cache.indexes[slot];
+            r++; g++; b++;
         }
     }
 
     return GIF_OK;
 }
-
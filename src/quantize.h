@@ -1,11 +1,31 @@
 #ifndef QUANTIZE_H
 #define QUANTIZE_H
 
+#include <vector>
+
 #include <gif_lib.h>
 
+#define QUANTIZE_CACHE_BITS 16
+
+// colors quantized so far, a direct mapped table of r<<16 | g<<8 | b: a
+// color whose slot is taken replaces the one there
+struct QuantizeCache {
+    int bits;
+    std::vector<unsigned int> colors; // bit 24 set in the used slots
+    std::vector<GifByteType> indexes;
+
+    QuantizeCache(int bbits=QUANTIZE_CACHE_BITS) :
+        bits(bbits), colors(1 << bbits), indexes(1 << bbits) {}
+    int slot(unsigned int color) const { return (color*2654435761u) >> (32 - bits); }
+};
+
 int web_safe_quantize(int width, int height,
     GifByteType *r, GifByteType *g, GifByteType *b,
     GifByteType *out);
+// the same, remembering colors in cache across calls
+int web_safe_quantize(int width, int height,
+    GifByteType *r, GifByteType *g, GifByteType *b,
+    GifByteType *out, QuantizeCache &cache);
 
 #endif
 
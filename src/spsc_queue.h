@@ -0,0 +1,66 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <vector>
+
+#include <uv.h>
+
+// A bounded queue between exactly one producer and one consumer thread.
+// Each side only ever moves its own index, so pushing and popping take no
+// lock; the semaphores just put a side to sleep while the ring is full or
+// empty (and order the slot accesses between the two).
+template <typename T>
+class SpscQueue {
+    std::vector<T> ring;
+    volatile unsigned head, tail; // next to pop, next to push
+    uv_sem_t items, slots;
+
+public:
+    SpscQueue(int capacity) : ring(capacity), head(0), tail(0)
+    {
+        uv_sem_init(&items, 0);
+        uv_sem_init(&slots, capacity);
+    }
+
+    ~SpscQueue()
+    {
+        uv_sem_destroy(&slots);
+        uv_sem_destroy(&items);
+    }
+
+    // producer only, waits while the queue is full
+    void push(const T &item)
+    {
+        uv_sem_wait(&slots);
+        ring[tail % ring.size()] = item;
+        __sync_synchronize();
+        tail = tail + 1;
+        uv_sem_post(&items);
+    }
+
+    // consumer only, waits while the queue is empty
+    T pop()
+    {
+        uv_sem_wait(&items);
+        T item = ring[head % ring.size()];
+        __sync_synchronize();
+        head = head + 1;
+        uv_sem_post(&slots);
+        return item;
+    }
+
+    // as seen by the producer: what's waiting, at least
+    unsigned size() const
+    {
+        __sync_synchronize();
+        return tail - head;
+    }
+
+    // as seen by the producer: true until the consumer takes something
+    bool full() const
+    {
+        return size() >= ring.size();
+    }
+};
+
+#endif
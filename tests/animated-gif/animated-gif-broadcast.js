@@ -0,0 +1,100 @@
+var GifLib = require('../..');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+
+// Subscribers of a broadcast have to get the same bytes as the gif kept in
+// memory: one that's there from the start all of them up to its unsubscribe,
+// a late one the header, a keyframe of the screen and then every frame after
+// it joined.
+
+var width = 100, height = 60;
+
+function fill(w, h, r, g, b) {
+    var rgb = new Buffer(w*h*3);
+    for (var i = 0; i < w*h*3; i += 3) {
+        rgb[i] = r; rgb[i+1] = g; rgb[i+2] = b;
+    }
+    return rgb;
+}
+
+function collect(chunks) {
+    return function (chunk) {
+        chunks.push(chunk);
+    }
+}
+
+var animatedGif = new GifLib.AnimatedGif(width, height);
+animatedGif.setBroadcast();
+animatedGif.setMemoryOutput(true);
+
+var offsets = [];
+animatedGif.setFrameCallback(function (frame, offset, length, delay) {
+    offsets[frame] = offset;
+});
+
+var early = [], late = [];
+var earlyId = animatedGif.subscribe(collect(early), 0);
+var lateJoined, earlyLeft;
+
+for (var frame = 0; frame < 10; frame++) {
+    if (frame == 0)
+        animatedGif.push(fill(width, height, 0x33, 0x66, 0x99), 0, 0, width, height);
+    animatedGif.push(fill(20, 20, frame*40 % 256, 0xcc, 0), frame*7, frame*4, 20, 20);
+    animatedGif.endPush(10);
+
+    if (frame == 3) {
+        animatedGif.subscribe(collect(late), 0);
+        lateJoined = frame + 1;
+    }
+    if (frame == 6) {
+        animatedGif.unsubscribe(earlyId);
+        earlyLeft = frame + 1;
+    }
+}
+
+var gif = animatedGif.getGif();
+early = Buffer.concat(early);
+late = Buffer.concat(late);
+
+fs.writeFileSync('animated-broadcast.gif', gif.toString('binary'), 'binary');
+fs.writeFileSync('animated-broadcast-late.gif', late.toString('binary'), 'binary');
+
+function same(a, aStart, b, bStart, length) {
+    for (var i = 0; i < length; i++) {
+        if (a[aStart + i] != b[bStart + i])
+            return false;
+    }
+    return true;
+}
+
+function fail(message) {
+    sys.log(message);
+    process.exit(1);
+}
+
+// the header and the screen descriptor vary in the first 13 bytes
+if (early.length != offsets[earlyLeft] || !same(early, 13, gif, 13, early.length - 13))
+    fail("The early subscriber didn't get the gif up to its unsubscribe.");
+
+var headerLength = offsets[0];
+var rest = gif.length - offsets[lateJoined];
+var keyframeLength = late.length - headerLength - rest;
+if (keyframeLength <= 0)
+    fail("The late subscriber got no keyframe.");
+if (!same(late, 13, gif, 13, headerLength - 13))
+    fail("The late subscriber didn't get the gif's header.");
+if (!same(late, late.length - rest, gif, offsets[lateJoined], rest))
+    fail("The late subscriber didn't get the frames after it joined.");
+
+// a graphics control extension and a full screen image
+var k = headerLength;
+var image = k + 8;
+if (late[k] != 0x21 || late[k+1] != 0xf9 || late[image] != 0x2c ||
+    late.readUInt16LE(image + 1) != 0 || late.readUInt16LE(image + 3) != 0 ||
+    late.readUInt16LE(image + 5) != width || late.readUInt16LE(image + 7) != height)
+{
+    fail("The late subscriber's keyframe isn't a full screen image.");
+}
+
+sys.log("Subscribers got the same bytes as the gif, the late one after a keyframe.");
@@ -0,0 +1,165 @@
+var GifLib = require('../..');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+var fixtures = require('../fixtures');
+var fail = fixtures.fail;
+
+// Decodes the animations AnimatedGif makes and checks that they show what was
+// pushed, for as long as it was meant to be shown: with only the changes
+// encoded, with repeats folded into the delay before them or written as
+// 1x1 no-op images, with unchanged pixels transparent, from a persistent
+// canvas and with frames split into several images.
+
+var width = 96, height = 64;
+
+// web safe colors, which the palette has exactly
+var levels = [0x00, 0x33, 0x66, 0x99, 0xcc, 0xff];
+
+// what each frame paints on the screen, what it pushes of it and its delay
+var steps = [
+    { paint: [[0, 0, 96, 64, 0]], push: [[0, 0, 96, 64]], delay: 10 },
+    { paint: [[8, 8, 10, 6, 1]], push: [[8, 8, 10, 6]], delay: 10 },
+    { paint: [], push: [[8, 8, 10, 6]], delay: 7 },              // the same again
+    { paint: [], push: [], delay: 5 },                           // nothing pushed
+    { paint: [[0, 0, 6, 6, 2], [88, 56, 8, 8, 3]],               // far apart
+      push: [[0, 0, 6, 6], [88, 56, 8, 8]], delay: 20 },
+    { paint: [[40, 10, 3, 3, 4], [50, 20, 2, 2, 5]],             // mostly unchanged
+      push: [[0, 0, 96, 32]], delay: 10 },
+    { paint: [[0, 0, 96, 64, 1]], push: [[0, 0, 96, 64]], delay: 3 },
+    { paint: [[60, 40, 20, 10, 2]], push: [[60, 40, 20, 10]], delay: 12 }
+];
+var repeats = 2;
+
+function paint(screen, x0, y0, w, h, k) {
+    for (var y = y0; y < y0 + h; y++) {
+        for (var x = x0; x < x0 + w; x++) {
+            var i = (y*width + x)*3;
+            screen[i] = levels[(x + k) % 6];
+            screen[i+1] = levels[(y + 2*k) % 6];
+            screen[i+2] = levels[(x*y + k) % 6];
+        }
+    }
+}
+
+function cut(screen, x0, y0, w, h) {
+    var rgb = new Buffer(w*h*3);
+    for (var y = 0; y < h; y++)
+        screen.copy(rgb, y*w*3, ((y0 + y)*width + x0)*3, ((y0 + y)*width + x0 + w)*3);
+    return rgb;
+}
+
+// pushes every step, returning the screen after each
+function run(animatedGif) {
+    var screen = new Buffer(width*height*3), screens = [];
+    steps.forEach(function (step) {
+        step.paint.forEach(function (p) {
+            paint(screen, p[0], p[1], p[2], p[3], p[4]);
+        });
+        step.push.forEach(function (p) {
+            animatedGif.push(cut(screen, p[0], p[1], p[2], p[3]), p[0], p[1], p[2], p[3]);
+        });
+        animatedGif.endPush(step.delay);
+        var copy = new Buffer(screen.length);
+        screen.copy(copy);
+        screens.push(copy);
+    });
+    return screens;
+}
+
+function equal(a, b) {
+    for (var i = 0; i < a.length; i++) {
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
+
+// every 1/100s has to show the screen of the step it belongs to
+function checkTimeline(name, gif, screens) {
+    fs.writeFileSync('animated-decode-' + name + '.gif', gif.toString('binary'), 'binary');
+    var images = fixtures.decode(gif).images;
+    var expected = [], shown = [];
+    steps.forEach(function (step, i) {
+        for (var t = 0; t < step.delay; t++)
+            expected.push(screens[i]);
+    });
+    images.forEach(function (image) {
+        for (var t = 0; t < image.delay; t++)
+            shown.push(image.screen);
+    });
+    if (shown.length != expected.length)
+        fail(name + ": the animation lasts " + shown.length + " instead of " + expected.length + ".");
+    for (var t = 0; t < expected.length; t++) {
+        if (!equal(shown[t], expected[t]))
+            fail(name + ": the wrong screen is shown at " + t + "/100s.");
+    }
+    return images;
+}
+
+// kept in memory only: repeats are folded into the frame before them
+var plain = new GifLib.AnimatedGif(width, height);
+var screens = run(plain);
+var images = checkTimeline('plain', plain.getGif(), screens);
+if (images.length != steps.length - repeats)
+    fail("plain: " + images.length + " images, the repeats weren't folded.");
+
+// with output as it's made, repeats are 1x1 no-op images
+var chunks = [];
+var live = new GifLib.AnimatedGif(width, height);
+live.setOutputCallback(function (chunk) {
+    chunks.push(chunk);
+});
+live.setDeltaTransparency(true);
+run(live);
+live.end();
+images = checkTimeline('live', Buffer.concat(chunks), screens);
+if (images.length != steps.length)
+    fail("live: " + images.length + " images instead of one per frame.");
+for (var i = 2; i <= 3; i++) {
+    var gif = Buffer.concat(chunks), image = fixtures.decode(gif).images[i];
+    if (!equal(image.screen, screens[1]))
+        fail("live: repeat " + i + " changed the screen.");
+}
+
+// pushes onto a persistent canvas are all the encoder looks at
+var persistent = new GifLib.AnimatedGif(width, height);
+persistent.setPersistentCanvas(true);
+persistent.setDeltaTransparency(true);
+run(persistent);
+images = checkTimeline('persistent', persistent.getGif(), screens);
+if (images.length != steps.length - repeats)
+    fail("persistent: " + images.length + " images, the repeats weren't folded.");
+
+// split frames show part of the change first, only their last image has to
+// show the whole screen, and their images' delays add up to the frame's
+var offsets = [];
+var split = new GifLib.AnimatedGif(width, height);
+split.setFrameImages(4);
+split.setFrameCallback(function (frame, offset, length, delay) {
+    offsets[frame] = offset + length;
+});
+run(split);
+gif = split.getGif();
+fs.writeFileSync('animated-decode-split.gif', gif.toString('binary'), 'binary');
+images = fixtures.decode(gif).images;
+if (offsets.length != steps.length)
+    fail("split: " + offsets.length + " frames instead of " + steps.length + ".");
+var next = 0, splitFrames = 0;
+for (var frame = 0; frame < steps.length; frame++) {
+    var delay = 0, first = next;
+    while (next < images.length && images[next].end <= offsets[frame])
+        delay += images[next++].delay;
+    if (next == first)
+        fail("split: frame " + frame + " has no images.");
+    if (next - first > 1)
+        splitFrames++;
+    if (!equal(images[next - 1].screen, screens[frame]))
+        fail("split: frame " + frame + " doesn't end on its screen.");
+    if (delay != steps[frame].delay)
+        fail("split: frame " + frame + " lasts " + delay + " instead of " + steps[frame].delay + ".");
+}
+if (!splitFrames)
+    fail("split: no frame was written as several images.");
+
+sys.log("The decoded animations show every frame for its delay.");
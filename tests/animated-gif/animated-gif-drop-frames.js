@@ -0,0 +1,113 @@
+var GifLib = require('../..');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+var fixtures = require('../fixtures');
+var fail = fixtures.fail;
+
+// With setDropFrames, frames the encoder thread falls behind on are dropped
+// and counted. Every endPush callback still has to come before the end one,
+// and each image of the gif has to show the screen of the last frame it
+// stands for, for as long as all of those frames together. Delays that would
+// add up to more than a gif delay holds (65535) are written as frames of
+// their own instead.
+
+var width = 160, height = 120, frames = 60;
+
+// web safe colors, which the palette has exactly
+var levels = [0x00, 0x33, 0x66, 0x99, 0xcc, 0xff];
+
+// a full screen of noise first and then rectangles of it all over, made in
+// advance so that endPush comes faster than the thread encodes
+var random = new fixtures.Random(7);
+var pushes = [], screens = [];
+var screen = new Buffer(width*height*3);
+for (var frame = 0; frame < frames; frame++) {
+    var w = frame ? width/2 : width, h = frame ? height/2 : height;
+    var x = frame ? frame*7 % (width - w) : 0, y = frame ? frame*5 % (height - h) : 0;
+    var rgb = new Buffer(w*h*3);
+    for (var i = 0; i < rgb.length; i++)
+        rgb[i] = levels[random.next() % 6];
+    for (var j = 0; j < h; j++)
+        rgb.copy(screen, ((y + j)*width + x)*3, j*w*3, (j + 1)*w*3);
+    pushes.push({ rgb: rgb, x: x, y: y, w: w, h: h });
+    var copy = new Buffer(screen.length);
+    screen.copy(copy);
+    screens.push(copy);
+}
+
+function equal(a, b) {
+    for (var i = 0; i < a.length; i++) {
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
+
+function check(name, gif, delays) {
+    fs.writeFileSync('animated-drop-' + name + '.gif', gif.toString('binary'), 'binary');
+    var images = fixtures.decode(gif).images;
+    var frame = 0;
+    images.forEach(function (image, i) {
+        var delay = 0;
+        while (frame < frames && delay < image.delay)
+            delay += delays[frame++];
+        if (delay != image.delay)
+            fail(name + ": image " + i + " lasts " + image.delay + " instead of " + delay + ".");
+        // frames sent because the next delay didn't fit anymore were sent
+        // by the next endPush, after its pushes
+        var cut = frame < frames && delay + delays[frame] > 0xffff;
+        if (!equal(image.screen, screens[frame - 1]) && !(cut && equal(image.screen, screens[frame])))
+            fail(name + ": image " + i + " doesn't show frame " + (frame - 1) + ".");
+    });
+    if (frame != frames)
+        fail(name + ": only " + frame + " of " + frames + " frames are in the gif.");
+    return images.length;
+}
+
+function run(name, delays, done) {
+    var animatedGif = new GifLib.AnimatedGif(width, height);
+    animatedGif.setEncoderThread(1);
+    animatedGif.setDropFrames(1);
+
+    var encoded = 0;
+    pushes.forEach(function (push, frame) {
+        animatedGif.push(push.rgb, push.x, push.y, push.w, push.h);
+        animatedGif.endPush(delays[frame], function (error) {
+            if (error)
+                fail(name + ": encoding a frame failed: " + error);
+            encoded++;
+        });
+    });
+
+    animatedGif.end(function (error) {
+        if (error)
+            fail(name + ": ending the encoder thread failed: " + error);
+        if (encoded != frames)
+            fail(name + ": only " + encoded + " of " + frames + " endPush callbacks came before the end.");
+        var dropped = animatedGif.getDroppedFrames();
+        var images = check(name, animatedGif.getGif(), delays);
+        done(dropped, images);
+    });
+}
+
+var shortDelays = [], longDelays = [];
+for (var frame = 0; frame < frames; frame++) {
+    shortDelays.push(5 + frame % 3);
+    longDelays.push(30000);
+}
+
+run('short', shortDelays, function (dropped, images) {
+    if (!dropped)
+        fail("short: no frame was dropped with a queue of 1.");
+    // the last frames, if they were dropped, are sent as one by end
+    if (images != frames - dropped && images != frames - dropped + 1)
+        fail("short: " + images + " images for " + frames + " frames with " + dropped + " dropped.");
+
+    // two frames of 30000 fit in one gif delay, a third doesn't
+    run('long', longDelays, function (dropped, images) {
+        if (images < Math.ceil(frames/2))
+            fail("long: " + images + " images can't hold " + frames + " frames of 30000.");
+        sys.log("Dropped " + dropped + " frames, the gifs still show every frame for its delay.");
+    });
+});
@@ -0,0 +1,70 @@
+var GifLib = require('../..');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+
+// Frames encoded on the encoder thread have to come out the same as ones
+// encoded in endPush, with every endPush callback called before the end one.
+
+var width = 160, height = 120, frames = 30;
+
+function fill(w, h, r, g, b) {
+    var rgb = new Buffer(w*h*3);
+    for (var i = 0; i < w*h*3; i += 3) {
+        rgb[i] = r; rgb[i+1] = g; rgb[i+2] = b;
+    }
+    return rgb;
+}
+
+function pushFrame(animatedGif, frame) {
+    if (frame == 0)
+        animatedGif.push(fill(width, height, 0xff, 0xff, 0xff), 0, 0, width, height);
+    animatedGif.push(fill(24, 16, frame*8 % 256, 0x33, 0x99),
+        frame*4 % (width - 24), frame*3 % (height - 16), 24, 16);
+}
+
+function fail(message) {
+    sys.log(message);
+    process.exit(1);
+}
+
+var plain = new GifLib.AnimatedGif(width, height);
+for (var frame = 0; frame < frames; frame++) {
+    pushFrame(plain, frame);
+    plain.endPush(10);
+}
+var expected = plain.getGif();
+
+var threaded = new GifLib.AnimatedGif(width, height);
+threaded.setEncoderThread(2);
+
+var encoded = 0, full = 0;
+for (var frame = 0; frame < frames; frame++) {
+    pushFrame(threaded, frame);
+    var more = threaded.endPush(10, function (error) {
+        if (error)
+            fail("Encoding a frame on the encoder thread failed: " + error);
+        encoded++;
+    });
+    if (!more)
+        full++;
+}
+
+threaded.end(function (error) {
+    if (error)
+        fail("Ending the encoder thread failed: " + error);
+    if (encoded != frames)
+        fail("Only " + encoded + " of " + frames + " endPush callbacks came before the end.");
+
+    var gif = threaded.getGif();
+    fs.writeFileSync('animated-encoder-thread.gif', gif.toString('binary'), 'binary');
+
+    // everything after the header and the screen descriptor
+    var same = gif.length == expected.length;
+    for (var i = 13; same && i < gif.length; i++)
+        same = gif[i] == expected[i];
+    if (!same)
+        fail("Frames encoded on the encoder thread differ from ones encoded in endPush.");
+
+    sys.log("The encoder thread made the same gif, the queue was full " + full + " times.");
+});
@@ -0,0 +1,62 @@
+var GifLib = require('../..');
+var Buffer = require('buffer').Buffer;
+var fs = require('fs');
+var sys = require('sys');
+
+// The same frames encoded lossy with and without setFrameThreads have to
+// come out the same.
+
+var chunkDirs = fs.readdirSync('.').sort().filter(
+    function (f) {
+        return /^\d+$/.test(f)
+    }
+);
+
+function rectDim(fileName) {
+    var m = fileName.match(/^\d+-rgb-(\d+)-(\d+)-(\d+)-(\d+).dat$/);
+    var dim = [m[1], m[2], m[3], m[4]].map(function (n) {
+        return parseInt(n, 10);
+    });
+    return { x: dim[0], y: dim[1], w: dim[2], h: dim[3] }
+}
+
+function encode(threads) {
+    var animatedGif = new GifLib.AnimatedGif(720,400);
+    animatedGif.setLossy(20);
+    animatedGif.setDeltaTransparency(true);
+    if (threads)
+        animatedGif.setFrameThreads(threads);
+
+    chunkDirs.forEach(function (dir) {
+        var chunkFiles = fs.readdirSync(dir).sort().filter(
+            function (f) {
+                return /^\d+-rgb-\d+-\d+-\d+-\d+.dat/.test(f);
+            }
+        );
+        chunkFiles.forEach(function (chunkFile) {
+            var dims = rectDim(chunkFile);
+            var rgb = fs.readFileSync(dir + '/' + chunkFile); // returns buffer
+            animatedGif.push(rgb, dims.x, dims.y, dims.w, dims.h);
+        });
+        animatedGif.endPush(10);
+    });
+
+    return animatedGif.getGif();
+}
+
+var sequential = encode(0);
+var pooled = encode(2);
+
+fs.writeFileSync('animated-lossy.gif', sequential.toString('binary'), 'binary');
+fs.writeFileSync('animated-lossy-threads.gif', pooled.toString('binary'), 'binary');
+
+// everything after the header and the screen descriptor
+var same = sequential.length == pooled.length;
+for (var i = 13; same && i < sequential.length; i++)
+    same = sequential[i] == pooled[i];
+
+if (!same) {
+    sys.log("Lossy frames compressed on threads differ from sequential ones.");
+    process.exit(1);
+}
+sys.log("Lossy frames compressed on threads are the same as sequential ones.");
@@ -0,0 +1,169 @@
+var sys = require('sys');
+var Buffer = require('buffer').Buffer;
+
+// What the tests share: pictures that come out the same on every run, and
+// a GIF decoder to check what the encoders made of them.
+
+// pseudo random numbers of 15 bits, the same sequence for the same seed
+function Random(seed) {
+    this.seed = seed || 1;
+}
+
+Random.prototype.next = function () {
+    this.seed = (this.seed * 1103515245 + 12345) & 0x7fffffff;
+    return this.seed >> 16;
+}
+
+exports.Random = Random;
+
+// An rgb picture with noise in its first noiseRows rows and gradients below,
+// so that it has what compresses worst and what compresses well.
+exports.picture = function (width, height, noiseRows) {
+    var random = new Random();
+    var rgb = new Buffer(width*height*3);
+    for (var y = 0; y < height; y++) {
+        for (var x = 0; x < width; x++) {
+            var i = (y*width + x)*3;
+            if (y < noiseRows) {
+                rgb[i] = random.next() & 0xff;
+                rgb[i+1] = random.next() & 0xff;
+                rgb[i+2] = random.next() & 0xff;
+            }
+            else {
+                rgb[i] = x & 0xff;
+                rgb[i+1] = y & 0xff;
+                rgb[i+2] = (x*y) >> 8 & 0xff;
+            }
+        }
+    }
+    return rgb;
+}
+
+exports.fail = function (message) {
+    sys.log(message);
+    process.exit(1);
+}
+
+// Whether two GIFs are the same after the header and the screen descriptor,
+// whose first 13 bytes differ from run to run.
+exports.same = function (a, b) {
+    if (a.length != b.length)
+        return false;
+    for (var i = 13; i < a.length; i++) {
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
+
+// Decodes a GIF image by image. Every image comes with the screen as rgb
+// after it was drawn, its delay from the graphics control extension before
+// it and the offset just past it.
+exports.decode = function (gif) {
+    var width = gif.readUInt16LE(6), height = gif.readUInt16LE(8);
+    var screen = new Buffer(width*height*3);
+    screen.fill(0);
+    var images = [];
+    var p = 13, global = null, transparent = -1, delay = 0;
+    if (gif[10] & 0x80) {
+        global = gif.slice(p, p + 3*(2 << (gif[10] & 7)));
+        p += global.length;
+    }
+    while (p < gif.length && gif[p] != 0x3b) {
+        if (gif[p] == 0x21) {
+            if (gif[p+1] == 0xf9) {
+                transparent = gif[p+3] & 1 ? gif[p+6] : -1;
+                delay = gif.readUInt16LE(p+4);
+            }
+            p += 2;
+            while (gif[p])
+                p += gif[p] + 1;
+            p++;
+            continue;
+        }
+        if (gif[p] != 0x2c)
+            exports.fail("Unknown block " + gif[p] + " at " + p + ".");
+        var left = gif.readUInt16LE(p+1), top = gif.readUInt16LE(p+3);
+        var w = gif.readUInt16LE(p+5), h = gif.readUInt16LE(p+7);
+        var colors = global, flags = gif[p+9];
+        p += 10;
+        if (flags & 0x80) {
+            colors = gif.slice(p, p + 3*(2 << (flags & 7)));
+            p += colors.length;
+        }
+        var minCodeSize = gif[p++], data = [];
+        while (gif[p]) {
+            data.push(gif.slice(p + 1, p + 1 + gif[p]));
+            p += gif[p] + 1;
+        }
+        p++;
+        if (left + w > width || top + h > height)
+            exports.fail("An image at " + p + " reaches off the screen.");
+        var pixels = lzw(Buffer.concat(data), minCodeSize, w*h);
+        for (var y = 0; y < h; y++) {
+            for (var x = 0; x < w; x++) {
+                var c = pixels[y*w + x];
+                if (c == transparent)
+                    continue;
+                var o = ((top + y)*width + left + x)*3;
+                screen[o] = colors[3*c]; screen[o+1] = colors[3*c+1]; screen[o+2] = colors[3*c+2];
+            }
+        }
+        var copy = new Buffer(screen.length);
+        screen.copy(copy);
+        images.push({ screen: copy, delay: delay, end: p });
+        transparent = -1;
+        delay = 0;
+    }
+    return { width: width, height: height, images: images };
+}
+
+function lzw(data, minCodeSize, n) {
+    var clear = 1 << minCodeSize, eoi = clear + 1;
+    var size, prefix, suffix, next, prev;
+    var out = [], bit = 0;
+    function reset() {
+        size = minCodeSize + 1;
+        prefix = []; suffix = []; next = eoi + 1; prev = -1;
+        for (var i = 0; i < clear; i++)
+            suffix[i] = i;
+    }
+    function string(code) {
+        var s = [];
+        for (; code >= clear; code = prefix[code])
+            s.push(suffix[code]);
+        s.push(code);
+        return s.reverse();
+    }
+    reset();
+    while (bit + size <= data.length*8 && out.length < n) {
+        var code = 0;
+        for (var i = 0; i < size; i++, bit++)
+            code |= (data[bit >> 3] >> (bit & 7) & 1) << i;
+        if (code == clear) {
+            reset();
+            continue;
+        }
+        if (code == eoi)
+            break;
+        var s;
+        if (code < next)
+            s = string(code);
+        else if (code == next && prev >= 0)
+            s = string(prev), s.push(s[0]);
+        else
+            exports.fail("Bad LZW code " + code + ".");
+        if (prev >= 0 && next < 4096) {
+            prefix[next] = prev;
+            suffix[next] = s[0];
+            next++;
+            if (next == 1 << size && size < 12)
+                size++;
+        }
+        prev = code;
+        out.push.apply(out, s);
+    }
+    if (out.length < n)
+        exports.fail("An image has only " + out.length + " of its " + n + " pixels.");
+    return out;
+}
@@ -0,0 +1,54 @@
+var fs  = require('fs');
+var sys = require('sys');
+var Gif = require('..').Gif;
+var Buffer = require('buffer').Buffer;
+var fixtures = require('./fixtures');
+
+// A mixed screen: text, a noisy photo-like area and flat color. Keeping a
+// full LZW table must never cost much more than clearing it at once, even
+// after the table filled up on the noise.
+
+var width = 1000, height = 1000;
+var mixed = new Buffer(width*height*3);
+
+var random = new fixtures.Random();
+
+function pixel(x, y, r, g, b) {
+    var i = (y*width + x)*3;
+    mixed[i] = r; mixed[i+1] = g; mixed[i+2] = b;
+}
+
+for (var y = 0; y < height; y++) {
+    for (var x = 0; x < width; x++) {
+        if ((x < 500) == (y < 500)) {
+            // text
+            var cx = x % 8, cy = y % 16, ch = ((x >> 3)*7 + (y >> 4)*13) % 26;
+            if (cy > 3 && cy < 13 && (ch*37 + cx*11 + cy*5) % 7 < 2)
+                pixel(x, y, 0x20, 0x20, 0x20);
+            else
+                pixel(x, y, 0xf0, 0xf0, 0xf0);
+        }
+        else if (y < 500) {
+            pixel(x, y, random.next() & 0xff, random.next() & 0xff, random.next() & 0xff);
+        }
+        else {
+            var c = ((x/200|0) + (y/150|0)) % 3;
+            pixel(x, y, c*100, 50, 200 - c*60);
+        }
+    }
+}
+
+var cleared = new Gif(mixed, width, height, 'rgb').encodeSync();
+
+var kept = new Gif(mixed, width, height, 'rgb');
+kept.setClearThreshold(20);
+kept = kept.encodeSync();
+
+fs.writeFileSync('./mixed.gif', kept.toString('binary'), 'binary');
+
+sys.log("Cleared at once: " + cleared.length + " bytes, with threshold: " +
+    kept.length + " bytes");
+if (kept.length > cleared.length*1.05) {
+    sys.log("The clear threshold made the mixed image more than 5% bigger.");
+    process.exit(1);
+}
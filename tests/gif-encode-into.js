@@ -0,0 +1,47 @@
+var fs  = require('fs');
+var sys = require('sys');
+var Gif = require('..').Gif;
+var Buffer = require('buffer').Buffer;
+var fixtures = require('./fixtures');
+
+// encodeInto has to write the same GIF as encodeSync, at any offset, into a
+// target of maxEncodedSize bytes even for noise, and throw when it doesn't fit.
+
+var width = 300, height = 200;
+var noise = fixtures.picture(width, height, height);
+
+function check(tiles) {
+    var gif = new Gif(noise, width, height, 'rgb');
+    if (tiles)
+        gif.setTiles(64, 64, 2);
+    var expected = gif.encodeSync();
+
+    var ntiles = tiles ? Math.ceil(width/64)*Math.ceil(height/64) : 0;
+    var max = Gif.maxEncodedSize(width, height) + 30*ntiles;
+    if (expected.length > max) {
+        fixtures.fail("Noise took " + expected.length + " bytes, more than the " + max +
+            " of maxEncodedSize.");
+    }
+
+    var offset = 7;
+    var target = new Buffer(offset + max);
+    var len = gif.encodeInto(target, offset);
+    if (len != expected.length || !fixtures.same(target.slice(offset, offset + len), expected)) {
+        fixtures.fail("encodeInto" + (tiles ? " with tiles" : "") +
+            " wrote something else than encodeSync.");
+    }
+
+    var threw = false;
+    try {
+        gif.encodeInto(new Buffer(expected.length - 1));
+    }
+    catch (e) {
+        threw = true;
+    }
+    if (!threw)
+        fixtures.fail("encodeInto didn't throw on a target that's too small.");
+}
+
+check(false);
+check(true);
+sys.log("encodeInto wrote the same as encodeSync, within maxEncodedSize.");
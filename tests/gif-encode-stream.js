@@ -0,0 +1,48 @@
+var fs  = require('fs');
+var sys = require('sys');
+var Gif = require('..').Gif;
+var Buffer = require('buffer').Buffer;
+var fixtures = require('./fixtures');
+var fail = fixtures.fail;
+
+// encodeStream has to deliver the same GIF as encodeSync, in chunks of at
+// least highWaterMark bytes but the last, and call the end callback once.
+
+var width = 400, height = 300;
+var rgb = fixtures.picture(width, height, height/2);
+
+var gif = new Gif(rgb, width, height, 'rgb');
+var expected = gif.encodeSync();
+
+var highWater = 4096;
+var chunks = [];
+var ends = 0;
+
+gif.encodeStream(
+    function (chunk) {
+        if (ends)
+            fail("A chunk came after the end callback.");
+        chunks.push(chunk);
+    },
+    function (error) {
+        if (++ends > 1)
+            fail("The end callback was called twice.");
+        if (error)
+            fail("encodeStream failed: " + error);
+
+        var streamed = Buffer.concat(chunks);
+        fs.writeFileSync('./stream.gif', streamed.toString('binary'), 'binary');
+
+        for (var i = 0; i + 1 < chunks.length; i++) {
+            if (chunks[i].length < highWater)
+                fail("Chunk " + i + " has only " + chunks[i].length + " bytes.");
+        }
+
+        if (!fixtures.same(streamed, expected))
+            fail("encodeStream delivered something else than encodeSync.");
+
+        sys.log("encodeStream delivered the same as encodeSync in " +
+            chunks.length + " chunks.");
+    },
+    highWater
+);
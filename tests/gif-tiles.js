@@ -0,0 +1,35 @@
+var fs  = require('fs');
+var sys = require('sys');
+var Gif = require('..').Gif;
+var fixtures = require('./fixtures');
+
+// A tiled GIF has to be one image per tile that together decode to the same
+// picture as the untiled GIF, and the same bytes whatever the thread count.
+
+var width = 600, height = 450, tile = 128;
+var rgb = fixtures.picture(width, height, height/3);
+
+var untiled = new Gif(rgb, width, height, 'rgb').encodeSync();
+
+var gif = new Gif(rgb, width, height, 'rgb');
+gif.setTiles(tile, tile, 1);
+var tiled = gif.encodeSync();
+gif.setTiles(tile, tile, 4);
+var threaded = gif.encodeSync();
+
+fs.writeFileSync('./tiles.gif', threaded.toString('binary'), 'binary');
+
+if (!fixtures.same(tiled, threaded))
+    fixtures.fail("Tiles compressed on 4 threads differ from ones compressed on 1.");
+
+var expected = fixtures.decode(untiled).images, decoded = fixtures.decode(threaded).images;
+var tiles = Math.ceil(width/tile)*Math.ceil(height/tile);
+if (decoded.length != tiles)
+    fixtures.fail("The tiled GIF has " + decoded.length + " images instead of " + tiles + ".");
+var picture = expected[expected.length - 1].screen, tiledPicture = decoded[decoded.length - 1].screen;
+for (var i = 0; i < picture.length; i++) {
+    if (picture[i] != tiledPicture[i])
+        fixtures.fail("The tiles decode to another picture at pixel " + Math.floor(i/3) + ".");
+}
+
+sys.log("The " + tiles + " tiles decode to the untiled picture.");